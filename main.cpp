@@ -13,8 +13,31 @@
 #include <string>
 #include <mutex>
 #include <optional>
-
-int uniqueId = 1;
+#include <list>
+#include <deque>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <cerrno>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <filesystem>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
 struct Command
 {
@@ -27,7 +50,9 @@ struct Command
         UnloadData,
         SaveData,
         SaveSpriteData,
-        EditSpriteData
+        EditSpriteData,
+        LevelData,
+        GenerateData
     } dataType = DataType::None;
 
     union Data
@@ -74,6 +99,23 @@ struct Command
             SaveData(const std::string &name) : fileName(name) {}
             ~SaveData() {}
         } saveData;
+        struct LevelData
+        {
+            int index;
+            LevelData() : index(0) {}
+            LevelData(int index) : index(index) {}
+            ~LevelData() {}
+        } levelData;
+        struct GenerateData
+        {
+            unsigned long long seed;
+            int style;
+            int width;
+            int height;
+            GenerateData() : seed(0), style(0), width(0), height(0) {}
+            GenerateData(unsigned long long seed, int style, int w, int h) : seed(seed), style(style), width(w), height(h) {}
+            ~GenerateData() {}
+        } generateData;
         Data() {}
         ~Data() {}
     };
@@ -106,6 +148,20 @@ struct Command
         dataType = DataType::EditSpriteData;
     }
 
+    void setLevelData(int index)
+    {
+        clearData();
+        new (&data->levelData) Data::LevelData(index);
+        dataType = DataType::LevelData;
+    }
+
+    void setGenerateData(unsigned long long seed, int style, int width, int height)
+    {
+        clearData();
+        new (&data->generateData) Data::GenerateData(seed, style, width, height);
+        dataType = DataType::GenerateData;
+    }
+
     void setUnloadData(int width, int height)
     {
         clearData();
@@ -127,6 +183,10 @@ struct Command
                 data->saveSpriteData.~SaveSpriteData();
             else if (dataType == DataType::EditSpriteData)
                 data->editSpriteData.~EditSpriteData();
+            else if (dataType == DataType::LevelData)
+                data->levelData.~LevelData();
+            else if (dataType == DataType::GenerateData)
+                data->generateData.~GenerateData();
 
             data.reset();
         }
@@ -159,7 +219,6 @@ enum SpriteType
 
 struct Sprite
 {
-    std::string identifier;
     SpriteType type;
     float x, y, z;
     float scaleX = 1;
@@ -169,6 +228,358 @@ struct Sprite
     std::optional<float> health;
 };
 
+// the fields every frame needs, the optional ones live in side tables of the pool
+struct SpriteData
+{
+    SpriteType type;
+    float x, y, z;
+    float scaleX;
+    float scaleY;
+    bool active;
+    uint8_t flags;
+};
+
+const uint8_t SpriteHasHealth = 1;
+const uint8_t SpriteHasDirection = 2;
+
+// slot in the low 32 bits, generation of the slot above it so handles to deleted sprites go stale,
+// both halves are full width so no slot count can spill into the generation
+typedef uint64_t SpriteHandle;
+const int spriteSlotBits = 32;
+const uint64_t spriteSlotMask = (static_cast<uint64_t>(1) << spriteSlotBits) - 1;
+const uint32_t noFreeSlot = UINT32_MAX;
+const uint32_t noCellSprite = UINT32_MAX;
+std::atomic<uint64_t> spriteChanges(0); // shared by every pool so versions never repeat across pools
+
+// grows in fixed size blocks that never move, so adding only allocates once per block
+template <typename T>
+struct BlockArray
+{
+    static const int blockBits = 10;
+    static const int blockSize = 1 << blockBits;
+    std::vector<std::unique_ptr<T[]>> blocks;
+
+    T &operator[](int i) { return blocks[i >> blockBits][i & (blockSize - 1)]; }
+    const T &operator[](int i) const { return blocks[i >> blockBits][i & (blockSize - 1)]; }
+
+    void reserve(int count)
+    {
+        while (blocks.size() * blockSize < count)
+        {
+            blocks.emplace_back(new T[blockSize]);
+        }
+    }
+
+    size_t bytes() const { return blocks.size() * blockSize * sizeof(T); }
+};
+
+// sprites are packed densely for drawing, deleting moves the last sprite into the hole and
+// handles are resolved through the slot table so they stay valid while the sprite exists
+struct SpritePool
+{
+    BlockArray<SpriteData> data;
+    BlockArray<float> health;
+    BlockArray<float> direction;
+    BlockArray<uint32_t> spriteCell;     // grid cell of every packed sprite
+    BlockArray<uint32_t> cellNext;       // next and previous packed sprite in the same cell
+    BlockArray<uint32_t> cellPrev;
+    BlockArray<uint32_t> denseSlot;      // slot of every packed sprite
+    BlockArray<uint32_t> slotDense;      // packed index of a live slot, next free slot of a free one
+    BlockArray<uint32_t> slotGeneration;
+    int count = 0;
+    int slotCount = 0;
+    uint32_t freeSlot = noFreeSlot;
+    uint64_t version = 0; // new value whenever a sprite is added, moved or removed
+
+    // the sprites of every map cell as lists over the packed indices, kept up to date in O(1) for the
+    // editor, the packed CSR arrays the game loads are only built from them when a file is written
+    int gridWidth = 0;
+    int gridHeight = 0;
+    std::vector<uint32_t> cellFirst; // noCellSprite when the cell is empty
+    mutable std::vector<uint32_t> cellOffsets; // gridWidth * gridHeight + 1 entries
+    mutable std::vector<uint32_t> cellSprites; // packed indices by cell, then by type
+    mutable bool bucketsDirty = true;
+
+    int size() const { return count; }
+    SpriteData &operator[](int index) { return data[index]; }
+    const SpriteData &operator[](int index) const { return data[index]; }
+
+    SpriteHandle handleAt(int index) const
+    {
+        uint32_t slot = denseSlot[index];
+        return static_cast<SpriteHandle>(slotGeneration[slot]) << spriteSlotBits | slot;
+    }
+
+    // packed index of the sprite, -1 when the handle is stale
+    int indexOf(SpriteHandle handle) const
+    {
+        uint64_t slot = handle & spriteSlotMask;
+        if (slot >= static_cast<uint64_t>(slotCount) || slotGeneration[slot] != handle >> spriteSlotBits)
+        {
+            return -1;
+        }
+        return slotDense[slot];
+    }
+
+    SpriteHandle add(const Sprite &sprite)
+    {
+        uint32_t slot;
+        if (freeSlot != noFreeSlot)
+        {
+            slot = freeSlot;
+            freeSlot = slotDense[slot];
+        }
+        else
+        {
+            slot = slotCount++;
+            slotDense.reserve(slotCount);
+            slotGeneration.reserve(slotCount);
+            slotGeneration[slot] = 1;
+        }
+
+        int index = count++;
+        data.reserve(count);
+        health.reserve(count);
+        direction.reserve(count);
+        spriteCell.reserve(count);
+        cellNext.reserve(count);
+        cellPrev.reserve(count);
+        denseSlot.reserve(count);
+        data[index] = {sprite.type, sprite.x, sprite.y, sprite.z, sprite.scaleX, sprite.scaleY, sprite.active, static_cast<uint8_t>((sprite.health ? SpriteHasHealth : 0) | (sprite.direction ? SpriteHasDirection : 0))};
+        health[index] = sprite.health.value_or(0);
+        direction[index] = sprite.direction.value_or(0);
+        denseSlot[index] = slot;
+        slotDense[slot] = index;
+        spriteCell[index] = cellOf(sprite.x, sprite.y);
+        link(index);
+        bucketsDirty = true;
+        version = ++spriteChanges;
+        return handleAt(index);
+    }
+
+    void removeAt(int index)
+    {
+        uint32_t slot = denseSlot[index];
+        unlink(index);
+        bucketsDirty = true;
+        version = ++spriteChanges;
+
+        int last = --count;
+        if (index != last)
+        {
+            data[index] = data[last];
+            health[index] = health[last];
+            direction[index] = direction[last];
+            spriteCell[index] = spriteCell[last];
+            denseSlot[index] = denseSlot[last];
+            slotDense[denseSlot[index]] = index;
+            if (gridWidth > 0)
+            {
+                // the last sprite keeps its place in its cell list under the new index
+                cellNext[index] = cellNext[last];
+                cellPrev[index] = cellPrev[last];
+                if (cellPrev[index] != noCellSprite)
+                    cellNext[cellPrev[index]] = index;
+                else
+                    cellFirst[spriteCell[index]] = index;
+                if (cellNext[index] != noCellSprite)
+                    cellPrev[cellNext[index]] = index;
+            }
+        }
+
+        // generations wrap around but never reach 0
+        slotGeneration[slot]++;
+        if (slotGeneration[slot] == 0)
+            slotGeneration[slot] = 1;
+        slotDense[slot] = freeSlot;
+        freeSlot = slot;
+    }
+
+    bool remove(SpriteHandle handle)
+    {
+        int index = indexOf(handle);
+        if (index == -1)
+        {
+            return false;
+        }
+        removeAt(index);
+        return true;
+    }
+
+    // frees every slot so old handles go stale, the blocks are kept for reuse
+    void clear()
+    {
+        while (count > 0)
+        {
+            removeAt(count - 1);
+        }
+    }
+
+    Sprite get(int index) const
+    {
+        const SpriteData &sprite = data[index];
+        Sprite result;
+        result.type = sprite.type;
+        result.x = sprite.x;
+        result.y = sprite.y;
+        result.z = sprite.z;
+        result.scaleX = sprite.scaleX;
+        result.scaleY = sprite.scaleY;
+        result.active = sprite.active;
+        if (sprite.flags & SpriteHasHealth)
+            result.health = health[index];
+        if (sprite.flags & SpriteHasDirection)
+            result.direction = direction[index];
+        return result;
+    }
+
+    void move(int index, float x, float y)
+    {
+        data[index].x = x;
+        data[index].y = y;
+        uint32_t cell = cellOf(x, y);
+        if (cell != spriteCell[index])
+        {
+            unlink(index);
+            spriteCell[index] = cell;
+            link(index);
+        }
+        bucketsDirty = true;
+        version = ++spriteChanges;
+    }
+
+    // sprites off the map are kept in the nearest edge cell so every sprite is in exactly one bucket
+    uint32_t cellOf(float x, float y) const
+    {
+        if (gridWidth <= 0)
+        {
+            return 0;
+        }
+        int cellX = std::clamp(static_cast<int>(std::floor(x / 64)), 0, gridWidth - 1);
+        int cellY = std::clamp(static_cast<int>(std::floor(y / 64)), 0, gridHeight - 1);
+        return cellX + cellY * gridWidth;
+    }
+
+    void link(int index)
+    {
+        if (gridWidth <= 0)
+        {
+            return;
+        }
+        uint32_t &first = cellFirst[spriteCell[index]];
+        cellPrev[index] = noCellSprite;
+        cellNext[index] = first;
+        if (first != noCellSprite)
+            cellPrev[first] = index;
+        first = index;
+    }
+
+    void unlink(int index)
+    {
+        if (gridWidth <= 0)
+        {
+            return;
+        }
+        if (cellPrev[index] != noCellSprite)
+            cellNext[cellPrev[index]] = cellNext[index];
+        else
+            cellFirst[spriteCell[index]] = cellNext[index];
+        if (cellNext[index] != noCellSprite)
+            cellPrev[cellNext[index]] = cellPrev[index];
+    }
+
+    void setGrid(int width, int height)
+    {
+        if (width == gridWidth && height == gridHeight)
+        {
+            return;
+        }
+        gridWidth = width;
+        gridHeight = height;
+        cellFirst.assign(width * height, noCellSprite);
+        for (int i = 0; i < count; i++)
+        {
+            spriteCell[i] = cellOf(data[i].x, data[i].y);
+            link(i);
+        }
+        bucketsDirty = true;
+    }
+
+    // counting sort by type and then a stable one by cell, O(sprites + cells)
+    void buildBuckets() const
+    {
+        if (!bucketsDirty)
+        {
+            return;
+        }
+        bucketsDirty = false;
+
+        int cells = gridWidth * gridHeight;
+        cellOffsets.assign(cells + 1, 0);
+        for (int i = 0; cells > 0 && i < count; i++)
+        {
+            cellOffsets[spriteCell[i] + 1]++;
+        }
+        for (int cell = 0; cell < cells; cell++)
+        {
+            cellOffsets[cell + 1] += cellOffsets[cell];
+        }
+
+        int types = 0;
+        for (int i = 0; i < count; i++)
+        {
+            types = std::max(types, data[i].type + 1);
+        }
+        std::vector<uint32_t> typeOffsets(types + 1, 0);
+        for (int i = 0; i < count; i++)
+        {
+            typeOffsets[data[i].type + 1]++;
+        }
+        for (int type = 0; type < types; type++)
+        {
+            typeOffsets[type + 1] += typeOffsets[type];
+        }
+        std::vector<uint32_t> byType(count);
+        for (int i = 0; i < count; i++)
+        {
+            byType[typeOffsets[data[i].type]++] = i;
+        }
+
+        cellSprites.assign(cells > 0 ? count : 0, 0);
+        if (cells == 0)
+        {
+            return;
+        }
+        std::vector<uint32_t> next(cellOffsets.begin(), cellOffsets.end() - 1);
+        for (uint32_t i : byType)
+        {
+            cellSprites[next[spriteCell[i]]++] = i;
+        }
+    }
+
+    void setHealth(int index, float value)
+    {
+        health[index] = value;
+        data[index].flags |= SpriteHasHealth;
+    }
+
+    void setDirection(int index, float value)
+    {
+        direction[index] = value;
+        data[index].flags |= SpriteHasDirection;
+    }
+
+    void swap(SpritePool &other)
+    {
+        std::swap(*this, other);
+    }
+
+    size_t bytes() const
+    {
+        return data.bytes() + health.bytes() + direction.bytes() + spriteCell.bytes() + cellNext.bytes() + cellPrev.bytes() + denseSlot.bytes() + slotDense.bytes() + slotGeneration.bytes() + (cellFirst.size() + cellOffsets.size() + cellSprites.size()) * sizeof(uint32_t);
+    }
+};
+
 int mapWidth;
 int mapHeight;
 int cellType = 1;
@@ -177,9 +588,36 @@ std::atomic<bool> running(true);
 std::mutex commandMutex;
 Command command;
 
-std::vector<Sprite> sprites;
+SpritePool sprites;
 std::vector<SDL_Texture *> textures;
 std::vector<SDL_Texture *> spriteTextures;
+// average ARGB colour of every texture, used when cells are too small to draw the texture itself
+std::vector<Uint32> textureColours;
+std::vector<Uint32> spriteColours;
+
+// each layer is kept in its own render target and only the cells that changed are redrawn
+struct LayerCache
+{
+    SDL_Texture *texture = nullptr;
+    std::vector<int> drawn; // cell values currently in the texture, empty when it must be rebuilt
+    float cellWidth = 0;
+    float cellHeight = 0;
+};
+
+LayerCache layerCaches[3];
+
+// the minimap is only rasterized again when its layer, the sprites or the colours change
+struct MinimapCache
+{
+    std::vector<int> drawn;
+    uint64_t spriteVersion = 0;
+    int mapWidth = 0;
+    int pixelWidth = 0;
+    int pixelHeight = 0;
+};
+MinimapCache minimapCache;
+Uint8 layerAlpha[3] = {255, 160, 96};
+bool compositeView = false;
 std::vector<std::string> texturePaths = {
     "./textures/texture-1.png",
     "./textures/texture-2.png",
@@ -216,6 +654,102 @@ std::vector<std::string> spritePaths = {
     "./textures/goldBar.png",
     "./textures/swat.png",
 };
+std::vector<std::string> levelPaths = {
+    "map.dat",
+    "map2.dat",
+    "map3.dat",
+    "map4.dat",
+    "map5.dat",
+    "map6.dat",
+    "map7.dat",
+    "map8.dat",
+    "map9.dat",
+    "map10.dat",
+    "map11.dat",
+};
+std::vector<std::string> levelSpritePaths = {
+    "sprites.dat",
+    "sprites2.dat",
+    "sprites3.dat",
+    "sprites4.dat",
+    "sprites5.dat",
+    "sprites6.dat",
+    "sprites7.dat",
+    "sprites8.dat",
+    "sprites9.dat",
+    "sprites10.dat",
+    "sprites11.dat",
+};
+
+struct Level
+{
+    int index;
+    int mapWidth;
+    int mapHeight;
+    std::vector<int> map;
+    std::vector<int> mapFloors;
+    std::vector<int> mapCeiling;
+    SpritePool sprites;
+    bool dirty = false;
+    bool spritesOwned = true; // see levelSpritesOwned
+
+    size_t bytes() const
+    {
+        return (map.size() + mapFloors.size() + mapCeiling.size()) * sizeof(int) + sprites.bytes();
+    }
+};
+
+// levels that are not being edited stay resident here, most recently used at the front
+std::list<Level> levelCache;
+size_t levelCacheLimit = 64 * 1024 * 1024;
+std::mutex levelCacheMutex;
+std::condition_variable prefetchCondition;
+std::deque<int> prefetchQueue;
+std::atomic<int> currentLevel(0);
+bool levelDirty = false;
+
+// the open level's sprites only go to its sprite file when they were read from it or edited since the
+// level was opened, a new or unloaded map must not replace the file with an unrelated list
+bool levelSpritesLoaded = false;
+uint64_t levelSpritesVersion = 0;
+
+bool levelSpritesOwned()
+{
+    return levelSpritesLoaded || sprites.version != levelSpritesVersion;
+}
+
+struct Edit
+{
+    enum Type
+    {
+        Invalid,
+        PaintRect,
+        SetCell,
+        AddSprite,
+        EditSprite,
+        MoveSprite,
+        DeleteSprite,
+        Save,
+        SaveSprites,
+        Generate,
+        Sync
+    } type = Type::Invalid;
+
+    int client = 0;
+    int layer = 0;
+    int x = 0, y = 0, w = 1, h = 1;
+    int value = 0;
+    float spriteX = 0, spriteY = 0, z = 0;
+    float scaleX = 1, scaleY = 1;
+    float health = -1, direction = -1;
+    unsigned long long seed = 0;
+    std::string text; // sprite identifier, file name or sync tag
+};
+
+// edits pushed by the socket and stdin script readers, applied in bulk once per frame
+std::mutex scriptMutex;
+std::vector<Edit> scriptEdits;
+std::vector<std::pair<int, std::string>> scriptAcks;
 
 void serialize(int mapWidth, int mapHeight, const std::vector<int> &map, const std::vector<int> &mapFloors, const std::vector<int> &mapCeiling, const std::string &filename)
 {
@@ -275,84 +809,2372 @@ void deserialize(int *mapWidth, int *mapHeight, std::vector<int> *map, std::vect
     }
 }
 
-void serializeSprites(const std::string &filename)
+void writeSprite(std::ofstream &file, const Sprite &sprite)
+{
+    int type = static_cast<int>(sprite.type);
+    file.write(reinterpret_cast<const char *>(&type), sizeof(int));
+    file.write(reinterpret_cast<const char *>(&sprite.x), sizeof(sprite.x));
+    file.write(reinterpret_cast<const char *>(&sprite.y), sizeof(sprite.y));
+    file.write(reinterpret_cast<const char *>(&sprite.z), sizeof(sprite.z));
+    file.write(reinterpret_cast<const char *>(&sprite.scaleX), sizeof(sprite.scaleX));
+    file.write(reinterpret_cast<const char *>(&sprite.scaleY), sizeof(sprite.scaleY));
+    file.write(reinterpret_cast<const char *>(&sprite.active), sizeof(sprite.active));
+    bool hasHealth = sprite.health.has_value();
+    file.write(reinterpret_cast<const char *>(&hasHealth), sizeof(hasHealth));
+    if (hasHealth)
+    {
+        file.write(reinterpret_cast<const char *>(&sprite.health.value()), sizeof(sprite.health.value()));
+    }
+    bool hasDirection = sprite.direction.has_value();
+    file.write(reinterpret_cast<const char *>(&hasDirection), sizeof(hasDirection));
+    if (hasDirection)
+    {
+        file.write(reinterpret_cast<const char *>(&sprite.direction.value()), sizeof(sprite.direction.value()));
+    }
+}
+
+void readSprite(std::ifstream &file, Sprite *sprite)
+{
+    int type;
+    file.read(reinterpret_cast<char *>(&type), sizeof(int));
+    sprite->type = static_cast<SpriteType>(type);
+    file.read(reinterpret_cast<char *>(&sprite->x), sizeof(float));
+    file.read(reinterpret_cast<char *>(&sprite->y), sizeof(float));
+    file.read(reinterpret_cast<char *>(&sprite->z), sizeof(float));
+    file.read(reinterpret_cast<char *>(&sprite->scaleX), sizeof(float));
+    file.read(reinterpret_cast<char *>(&sprite->scaleY), sizeof(float));
+    file.read(reinterpret_cast<char *>(&sprite->active), sizeof(bool));
+    bool hasHealth;
+    file.read(reinterpret_cast<char *>(&hasHealth), sizeof(bool));
+    if (hasHealth)
+    {
+        float health;
+        file.read(reinterpret_cast<char *>(&health), sizeof(float));
+        sprite->health = health;
+    }
+    bool hasDirection;
+    file.read(reinterpret_cast<char *>(&hasDirection), sizeof(bool));
+    if (hasDirection)
+    {
+        float direction;
+        file.read(reinterpret_cast<char *>(&direction), sizeof(float));
+        sprite->direction = direction;
+    }
+}
+
+// the game reads <sprite file>.cells to find the sprites of a cell without scanning them all,
+// the sprites of cell c are indices[offsets[c]] up to indices[offsets[c + 1]] in sprite file order
+struct SpriteCellHeader
+{
+    char magic[4]; // "RCSC"
+    uint32_t version;
+    int32_t mapWidth;
+    int32_t mapHeight;
+    uint32_t spriteCount;
+};
+
+void serializeSpriteCells(const SpritePool &sprites, const std::string &filename)
+{
+    std::ofstream file(filename, std::ios::binary | std::ios::out);
+    if (!file)
+    {
+        std::cerr << "Error opening file for writing.\n";
+        return;
+    }
+    sprites.buildBuckets();
+
+    SpriteCellHeader header = {};
+    std::memcpy(header.magic, "RCSC", 4);
+    header.version = 1;
+    header.mapWidth = sprites.gridWidth;
+    header.mapHeight = sprites.gridHeight;
+    header.spriteCount = sprites.size();
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(sprites.cellOffsets.data()), sprites.cellOffsets.size() * sizeof(uint32_t));
+    file.write(reinterpret_cast<const char *>(sprites.cellSprites.data()), sprites.cellSprites.size() * sizeof(uint32_t));
+}
+
+void serializeSprites(const SpritePool &sprites, const std::string &filename)
 {
     std::ofstream file(filename, std::ios::binary | std::ios::out);
     if (file)
     {
         int spritesSize = sprites.size();
         file.write(reinterpret_cast<const char *>(&spritesSize), sizeof(spritesSize));
-        for (auto sprite : sprites)
+        for (int i = 0; i < sprites.size(); i++)
         {
-            int type = static_cast<int>(sprite.type);
-            file.write(reinterpret_cast<const char *>(&type), sizeof(int));
-            file.write(reinterpret_cast<const char *>(&sprite.x), sizeof(sprite.x));
-            file.write(reinterpret_cast<const char *>(&sprite.y), sizeof(sprite.y));
-            file.write(reinterpret_cast<const char *>(&sprite.z), sizeof(sprite.z));
-            file.write(reinterpret_cast<const char *>(&sprite.scaleX), sizeof(sprite.scaleX));
-            file.write(reinterpret_cast<const char *>(&sprite.scaleY), sizeof(sprite.scaleY));
-            file.write(reinterpret_cast<const char *>(&sprite.active), sizeof(sprite.active));
-            bool hasHealth = sprite.health.has_value();
-            file.write(reinterpret_cast<const char *>(&hasHealth), sizeof(hasHealth));
-            if (hasHealth)
-            {
-                file.write(reinterpret_cast<const char *>(&sprite.health.value()), sizeof(sprite.health.value()));
-            }
-            bool hasDirection = sprite.direction.has_value();
-            file.write(reinterpret_cast<const char *>(&hasDirection), sizeof(hasDirection));
-            if (hasDirection)
-            {
-                file.write(reinterpret_cast<const char *>(&sprite.direction.value()), sizeof(sprite.direction.value()));
-            }
+            writeSprite(file, sprites.get(i));
+        }
+
+        file.close();
+        if (sprites.gridWidth > 0)
+        {
+            serializeSpriteCells(sprites, filename + ".cells");
+        }
+    }
+    else
+    {
+        std::cerr << "Error opening file for writing.\n";
+    }
+}
+
+void deserializeSprites(SpritePool *sprites, const std::string &filename)
+{
+    std::ifstream file(filename, std::ios::binary | std::ios::in);
+    if (file)
+    {
+        int spritesSize;
+        file.read(reinterpret_cast<char *>(&spritesSize), sizeof(int));
+        for (int i = 0; i < spritesSize; i++)
+        {
+            Sprite sprite;
+            readSprite(file, &sprite);
+            sprites->add(sprite);
+        }
+        file.close();
+    }
+    else
+    {
+        std::cerr << "Error opening file for reading.\n";
+    }
+}
+
+// a rectangle of all three layers plus the sprites on it, sprite positions are relative to its top left corner
+struct Prefab
+{
+    int width = 0;
+    int height = 0;
+    std::vector<int> layers[3]; // walls, floors, ceiling
+    std::vector<Sprite> sprites;
+};
+
+void serializePrefab(const Prefab &prefab, const std::string &filename)
+{
+    std::ofstream file(filename, std::ios::binary | std::ios::out);
+    if (file)
+    {
+        file.write(reinterpret_cast<const char *>(&prefab.width), sizeof(prefab.width));
+        file.write(reinterpret_cast<const char *>(&prefab.height), sizeof(prefab.height));
+        for (const std::vector<int> &layer : prefab.layers)
+        {
+            file.write(reinterpret_cast<const char *>(layer.data()), sizeof(int) * layer.size());
         }
 
+        int spritesSize = prefab.sprites.size();
+        file.write(reinterpret_cast<const char *>(&spritesSize), sizeof(spritesSize));
+        for (const Sprite &sprite : prefab.sprites)
+        {
+            writeSprite(file, sprite);
+        }
         file.close();
     }
     else
     {
-        std::cerr << "Error opening file for writing.\n";
+        std::cerr << "Error opening file for writing.\n";
+    }
+}
+
+bool deserializePrefab(Prefab *prefab, const std::string &filename)
+{
+    std::ifstream file(filename, std::ios::binary | std::ios::in);
+    if (!file)
+    {
+        std::cerr << "Error opening file for reading.\n";
+        return false;
+    }
+
+    file.read(reinterpret_cast<char *>(&prefab->width), sizeof(int));
+    file.read(reinterpret_cast<char *>(&prefab->height), sizeof(int));
+    for (std::vector<int> &layer : prefab->layers)
+    {
+        layer.resize(prefab->width * prefab->height);
+        file.read(reinterpret_cast<char *>(layer.data()), sizeof(int) * layer.size());
+    }
+
+    int spritesSize;
+    file.read(reinterpret_cast<char *>(&spritesSize), sizeof(int));
+    prefab->sprites.resize(spritesSize);
+    for (Sprite &sprite : prefab->sprites)
+    {
+        readSprite(file, &sprite);
+    }
+    return true;
+}
+
+const std::string prefabDirectory = "./prefabs/";
+
+bool spriteInRegion(float x, float y, const SDL_Rect &region)
+{
+    int cellX = static_cast<int>(std::floor(x / 64));
+    int cellY = static_cast<int>(std::floor(y / 64));
+    return cellX >= region.x && cellY >= region.y && cellX < region.x + region.w && cellY < region.y + region.h;
+}
+
+void copyRegion(const SDL_Rect &region, const std::vector<int> &map, const std::vector<int> &mapFloors, const std::vector<int> &mapCeiling, Prefab *prefab)
+{
+    const std::vector<int> *layers[3] = {&map, &mapFloors, &mapCeiling};
+    prefab->width = region.w;
+    prefab->height = region.h;
+    for (int layer = 0; layer < 3; layer++)
+    {
+        prefab->layers[layer].resize(region.w * region.h);
+        for (int y = 0; y < region.h; y++)
+        {
+            const int *row = layers[layer]->data() + (region.y + y) * mapWidth + region.x;
+            std::copy(row, row + region.w, prefab->layers[layer].begin() + y * region.w);
+        }
+    }
+
+    prefab->sprites.clear();
+    for (int i = 0; i < sprites.size(); i++)
+    {
+        if (spriteInRegion(sprites[i].x, sprites[i].y, region))
+        {
+            Sprite sprite = sprites.get(i);
+            sprite.x -= region.x * 64;
+            sprite.y -= region.y * 64;
+            prefab->sprites.push_back(sprite);
+        }
+    }
+}
+
+void clearRegion(const SDL_Rect &region, std::vector<int> *map, std::vector<int> *mapFloors, std::vector<int> *mapCeiling)
+{
+    std::vector<int> *layers[3] = {map, mapFloors, mapCeiling};
+    for (std::vector<int> *layer : layers)
+    {
+        for (int y = region.y; y < region.y + region.h; y++)
+        {
+            std::fill_n(layer->begin() + y * mapWidth + region.x, region.w, 0);
+        }
+    }
+
+    for (int i = sprites.size() - 1; i >= 0; i--)
+    {
+        if (spriteInRegion(sprites[i].x, sprites[i].y, region))
+        {
+            sprites.removeAt(i);
+        }
+    }
+}
+
+// stamps the prefab with its top left corner on the cell, clipped to the map
+void pastePrefab(const Prefab &prefab, int cellX, int cellY, std::vector<int> *map, std::vector<int> *mapFloors, std::vector<int> *mapCeiling)
+{
+    int x0 = std::max(cellX, 0);
+    int y0 = std::max(cellY, 0);
+    int x1 = std::min(cellX + prefab.width, mapWidth);
+    int y1 = std::min(cellY + prefab.height, mapHeight);
+    if (x0 >= x1 || y0 >= y1)
+    {
+        return;
+    }
+
+    std::vector<int> *layers[3] = {map, mapFloors, mapCeiling};
+    for (int layer = 0; layer < 3; layer++)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            const int *row = prefab.layers[layer].data() + (y - cellY) * prefab.width + (x0 - cellX);
+            std::copy(row, row + (x1 - x0), layers[layer]->begin() + y * mapWidth + x0);
+        }
+    }
+
+    SDL_Rect area = {x0, y0, x1 - x0, y1 - y0};
+    float offsetX = cellX * 64.0f;
+    float offsetY = cellY * 64.0f;
+    for (const Sprite &sprite : prefab.sprites)
+    {
+        if (spriteInRegion(sprite.x + offsetX, sprite.y + offsetY, area))
+        {
+            Sprite placed = sprite;
+            placed.x += offsetX;
+            placed.y += offsetY;
+            sprites.add(placed);
+        }
+    }
+}
+
+// quarter turn clockwise
+// flips a sprite coordinate inside [0, size), one on the near edge would land on size, a cell outside
+// the prefab, so it is pulled in by one unit instead
+float flipCoordinate(float value, int size)
+{
+    return std::min(size - value, size - 1.0f);
+}
+
+void rotatePrefab(Prefab *prefab)
+{
+    int width = prefab->height;
+    int height = prefab->width;
+    for (std::vector<int> &layer : prefab->layers)
+    {
+        std::vector<int> rotated(layer.size());
+        for (int y = 0; y < prefab->height; y++)
+        {
+            for (int x = 0; x < prefab->width; x++)
+            {
+                rotated[(prefab->height - 1 - y) + x * width] = layer[x + y * prefab->width];
+            }
+        }
+        layer.swap(rotated);
+    }
+
+    for (Sprite &sprite : prefab->sprites)
+    {
+        float x = sprite.x;
+        sprite.x = flipCoordinate(sprite.y, prefab->height * 64);
+        sprite.y = x;
+    }
+    prefab->width = width;
+    prefab->height = height;
+}
+
+// left to right
+void mirrorPrefab(Prefab *prefab)
+{
+    for (std::vector<int> &layer : prefab->layers)
+    {
+        for (int y = 0; y < prefab->height; y++)
+        {
+            std::reverse(layer.begin() + y * prefab->width, layer.begin() + (y + 1) * prefab->width);
+        }
+    }
+
+    for (Sprite &sprite : prefab->sprites)
+    {
+        sprite.x = flipCoordinate(sprite.x, prefab->width * 64);
+    }
+}
+
+// runtime bundle: header, entry table, then every blob at a 64 byte aligned offset so the
+// file can be mmapped and used in place, textures are tightly packed RGBA32 rows
+enum BundleEntryKind : uint32_t
+{
+    BundleWalls,
+    BundleFloors,
+    BundleCeiling,
+    BundleSprites,
+    BundleTexture,
+    BundleSpriteTexture,
+    BundleCellOffsets, // uint32 per cell plus one, see SpriteCellHeader
+    BundleCellSprites  // uint32 sprite index, sorted by cell and then by type
+};
+
+struct BundleHeader
+{
+    char magic[4]; // "RCBN"
+    uint32_t version;
+    uint32_t entryCount;
+    uint32_t alignment;
+    int32_t mapWidth;
+    int32_t mapHeight;
+    uint32_t reserved[2];
+};
+
+struct BundleEntry
+{
+    uint32_t kind;
+    uint32_t index;       // texture or sprite texture slot
+    uint64_t offset;      // from the start of the file
+    uint64_t size;        // in bytes
+    uint32_t width;       // cells or pixels
+    uint32_t height;      // cells or pixels
+    uint32_t elementSize; // bytes per cell, sprite or pixel
+    uint32_t count;       // cells, sprites or pixels
+};
+
+struct BundleSprite
+{
+    int32_t type;
+    float x, y, z;
+    float scaleX, scaleY;
+    float health;    // valid when flags & 2
+    float direction; // valid when flags & 4
+    uint32_t flags;  // 1 active, 2 has health, 4 has direction
+};
+
+static_assert(sizeof(BundleHeader) == 32, "bundle header layout changed");
+static_assert(sizeof(BundleEntry) == 40, "bundle entry layout changed");
+static_assert(sizeof(BundleSprite) == 36, "bundle sprite layout changed");
+
+const uint64_t bundleAlignment = 64;
+
+struct BundleBlob
+{
+    BundleEntry entry;
+    std::vector<char> bytes;
+};
+
+// stores a layer with the smallest cell type that fits every value
+void addBundleLayer(std::vector<BundleBlob> *blobs, uint32_t kind, int mapWidth, int mapHeight, const std::vector<int> &layer)
+{
+    int maxValue = 0;
+    for (int value : layer)
+    {
+        maxValue = std::max(maxValue, value);
+    }
+    uint32_t elementSize = maxValue < 256 ? 1 : maxValue < 65536 ? 2 : 4;
+
+    BundleBlob blob = {};
+    blob.entry.kind = kind;
+    blob.entry.width = mapWidth;
+    blob.entry.height = mapHeight;
+    blob.entry.elementSize = elementSize;
+    blob.entry.count = layer.size();
+    blob.bytes.resize(layer.size() * elementSize);
+    for (size_t i = 0; i < layer.size(); i++)
+    {
+        if (elementSize == 1)
+            blob.bytes[i] = static_cast<char>(layer[i]);
+        else if (elementSize == 2)
+            reinterpret_cast<uint16_t *>(blob.bytes.data())[i] = static_cast<uint16_t>(layer[i]);
+        else
+            reinterpret_cast<int32_t *>(blob.bytes.data())[i] = layer[i];
+    }
+    blobs->emplace_back(std::move(blob));
+}
+
+bool addBundleTexture(std::vector<BundleBlob> *blobs, uint32_t kind, uint32_t index, const std::string &path)
+{
+    SDL_Surface *loaded = IMG_Load(path.c_str());
+    if (!loaded)
+    {
+        printf("IMG_Load Error for %s: %s\n", path.c_str(), IMG_GetError());
+        return false;
+    }
+    SDL_Surface *surface = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_RGBA32, 0);
+    SDL_FreeSurface(loaded);
+    if (!surface)
+    {
+        return false;
+    }
+
+    BundleBlob blob = {};
+    blob.entry.kind = kind;
+    blob.entry.index = index;
+    blob.entry.width = surface->w;
+    blob.entry.height = surface->h;
+    blob.entry.elementSize = 4;
+    blob.entry.count = surface->w * surface->h;
+    blob.bytes.resize(surface->w * surface->h * 4);
+    SDL_LockSurface(surface);
+    for (int y = 0; y < surface->h; y++)
+    {
+        std::memcpy(blob.bytes.data() + y * surface->w * 4, static_cast<const char *>(surface->pixels) + y * surface->pitch, surface->w * 4);
+    }
+    SDL_UnlockSurface(surface);
+    SDL_FreeSurface(surface);
+    blobs->emplace_back(std::move(blob));
+    return true;
+}
+
+void serializeBundle(int mapWidth, int mapHeight, const std::vector<int> &map, const std::vector<int> &mapFloors, const std::vector<int> &mapCeiling, const SpritePool &sprites, const std::string &filename)
+{
+    std::vector<BundleBlob> blobs;
+    addBundleLayer(&blobs, BundleWalls, mapWidth, mapHeight, map);
+    addBundleLayer(&blobs, BundleFloors, mapWidth, mapHeight, mapFloors);
+    addBundleLayer(&blobs, BundleCeiling, mapWidth, mapHeight, mapCeiling);
+
+    BundleBlob spriteBlob = {};
+    spriteBlob.entry.kind = BundleSprites;
+    spriteBlob.entry.elementSize = sizeof(BundleSprite);
+    spriteBlob.entry.count = sprites.size();
+    spriteBlob.bytes.resize(sprites.size() * sizeof(BundleSprite));
+    for (size_t i = 0; i < sprites.size(); i++)
+    {
+        const Sprite sprite = sprites.get(i);
+        BundleSprite packed = {};
+        packed.type = sprite.type;
+        packed.x = sprite.x;
+        packed.y = sprite.y;
+        packed.z = sprite.z;
+        packed.scaleX = sprite.scaleX;
+        packed.scaleY = sprite.scaleY;
+        packed.health = sprite.health.value_or(0);
+        packed.direction = sprite.direction.value_or(0);
+        packed.flags = (sprite.active ? 1 : 0) | (sprite.health ? 2 : 0) | (sprite.direction ? 4 : 0);
+        std::memcpy(spriteBlob.bytes.data() + i * sizeof(BundleSprite), &packed, sizeof(BundleSprite));
+    }
+    blobs.emplace_back(std::move(spriteBlob));
+
+    sprites.buildBuckets();
+    BundleBlob offsetBlob = {};
+    offsetBlob.entry.kind = BundleCellOffsets;
+    offsetBlob.entry.width = sprites.gridWidth;
+    offsetBlob.entry.height = sprites.gridHeight;
+    offsetBlob.entry.elementSize = sizeof(uint32_t);
+    offsetBlob.entry.count = sprites.cellOffsets.size();
+    offsetBlob.bytes.resize(sprites.cellOffsets.size() * sizeof(uint32_t));
+    std::memcpy(offsetBlob.bytes.data(), sprites.cellOffsets.data(), offsetBlob.bytes.size());
+    blobs.emplace_back(std::move(offsetBlob));
+
+    BundleBlob cellSpriteBlob = {};
+    cellSpriteBlob.entry.kind = BundleCellSprites;
+    cellSpriteBlob.entry.elementSize = sizeof(uint32_t);
+    cellSpriteBlob.entry.count = sprites.cellSprites.size();
+    cellSpriteBlob.bytes.resize(sprites.cellSprites.size() * sizeof(uint32_t));
+    std::memcpy(cellSpriteBlob.bytes.data(), sprites.cellSprites.data(), cellSpriteBlob.bytes.size());
+    blobs.emplace_back(std::move(cellSpriteBlob));
+
+    for (int i = 0; i < texturePaths.size(); i++)
+    {
+        if (!addBundleTexture(&blobs, BundleTexture, i, texturePaths[i]))
+        {
+            std::cerr << "Bundle not written, a texture failed to load.\n";
+            return;
+        }
+    }
+    // sprite slots that share a png point at the same pixels, pairs of slot and the slot that owns the pixels
+    std::vector<std::pair<int, int>> sharedSlots;
+    for (int i = 0; i < spritePaths.size(); i++)
+    {
+        int owner = i;
+        for (int j = 0; j < i && owner == i; j++)
+        {
+            if (spritePaths[j] == spritePaths[i])
+                owner = j;
+        }
+        if (owner != i)
+        {
+            sharedSlots.push_back({i, owner});
+        }
+        else if (!addBundleTexture(&blobs, BundleSpriteTexture, i, spritePaths[i]))
+        {
+            std::cerr << "Bundle not written, a texture failed to load.\n";
+            return;
+        }
+    }
+
+    auto align = [](uint64_t offset)
+    {
+        return (offset + bundleAlignment - 1) / bundleAlignment * bundleAlignment;
+    };
+
+    BundleHeader header = {};
+    std::memcpy(header.magic, "RCBN", 4);
+    header.version = 1;
+    header.entryCount = blobs.size() + sharedSlots.size();
+    header.alignment = bundleAlignment;
+    header.mapWidth = mapWidth;
+    header.mapHeight = mapHeight;
+
+    uint64_t offset = align(sizeof(BundleHeader) + header.entryCount * sizeof(BundleEntry));
+    for (BundleBlob &blob : blobs)
+    {
+        blob.entry.offset = offset;
+        blob.entry.size = blob.bytes.size();
+        offset = align(offset + blob.bytes.size());
+    }
+    std::vector<BundleEntry> sharedEntries;
+    for (const std::pair<int, int> &slot : sharedSlots)
+    {
+        for (const BundleBlob &blob : blobs)
+        {
+            if (blob.entry.kind == BundleSpriteTexture && blob.entry.index == slot.second)
+            {
+                sharedEntries.push_back(blob.entry);
+                sharedEntries.back().index = slot.first;
+            }
+        }
+    }
+
+    std::ofstream file(filename, std::ios::binary | std::ios::out);
+    if (file)
+    {
+        const char padding[bundleAlignment] = {};
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        for (const BundleBlob &blob : blobs)
+        {
+            file.write(reinterpret_cast<const char *>(&blob.entry), sizeof(BundleEntry));
+        }
+        for (const BundleEntry &entry : sharedEntries)
+        {
+            file.write(reinterpret_cast<const char *>(&entry), sizeof(BundleEntry));
+        }
+        for (const BundleBlob &blob : blobs)
+        {
+            file.write(padding, blob.entry.offset - static_cast<uint64_t>(file.tellp()));
+            file.write(blob.bytes.data(), blob.bytes.size());
+        }
+        file.close();
+    }
+    else
+    {
+        std::cerr << "Error opening file for writing.\n";
+    }
+}
+
+bool fileExists(const std::string &filename)
+{
+    std::ifstream file(filename, std::ios::binary | std::ios::in);
+    return file.good();
+}
+
+bool loadLevel(int index, Level *level)
+{
+    if (!fileExists(levelPaths[index]))
+    {
+        return false;
+    }
+
+    level->index = index;
+    level->dirty = false;
+    deserialize(&level->mapWidth, &level->mapHeight, &level->map, &level->mapFloors, &level->mapCeiling, levelPaths[index]);
+    level->sprites.clear();
+    level->sprites.setGrid(level->mapWidth, level->mapHeight);
+    if (fileExists(levelSpritePaths[index]))
+    {
+        deserializeSprites(&level->sprites, levelSpritePaths[index]);
+    }
+    return true;
+}
+
+// must be called with levelCacheMutex held
+std::list<Level>::iterator findCachedLevel(int index)
+{
+    for (auto it = levelCache.begin(); it != levelCache.end(); it++)
+    {
+        if (it->index == index)
+        {
+            return it;
+        }
+    }
+    return levelCache.end();
+}
+
+// must be called with levelCacheMutex held, unsaved levels are never evicted
+void trimLevelCache()
+{
+    size_t total = 0;
+    for (const Level &level : levelCache)
+    {
+        total += level.bytes();
+    }
+
+    auto it = levelCache.end();
+    while (total > levelCacheLimit && it != levelCache.begin())
+    {
+        it--;
+        if (!it->dirty)
+        {
+            total -= it->bytes();
+            it = levelCache.erase(it);
+        }
+    }
+}
+
+void prefetchLevel(int index)
+{
+    if (index < 0 || index >= levelPaths.size())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(levelCacheMutex);
+        prefetchQueue.push_back(index);
+    }
+    prefetchCondition.notify_one();
+}
+
+void prefetchLevels()
+{
+    while (true)
+    {
+        int index;
+        {
+            std::unique_lock<std::mutex> lock(levelCacheMutex);
+            prefetchCondition.wait(lock, []
+                                   { return !running || !prefetchQueue.empty(); });
+            if (!running)
+            {
+                return;
+            }
+            index = prefetchQueue.front();
+            prefetchQueue.pop_front();
+            if (index == currentLevel || findCachedLevel(index) != levelCache.end())
+            {
+                continue;
+            }
+        }
+
+        Level level;
+        if (!loadLevel(index, &level))
+        {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(levelCacheMutex);
+        if (index != currentLevel && findCachedLevel(index) == levelCache.end())
+        {
+            levelCache.push_back(std::move(level));
+            trimLevelCache();
+        }
+    }
+}
+
+bool switchLevel(int index, std::vector<int> *map, std::vector<int> *mapFloors, std::vector<int> *mapCeiling)
+{
+    if (index < 0 || index >= levelPaths.size() || index == currentLevel)
+    {
+        return false;
+    }
+
+    Level incoming;
+    bool found = false;
+    {
+        std::lock_guard<std::mutex> lock(levelCacheMutex);
+        auto it = findCachedLevel(index);
+        if (it != levelCache.end())
+        {
+            incoming = std::move(*it);
+            levelCache.erase(it);
+            found = true;
+        }
+    }
+    if (!found && !loadLevel(index, &incoming))
+    {
+        std::cerr << "Level file not found: " << levelPaths[index] << std::endl;
+        return false;
+    }
+
+    Level outgoing;
+    outgoing.index = currentLevel;
+    outgoing.mapWidth = mapWidth;
+    outgoing.mapHeight = mapHeight;
+    outgoing.dirty = levelDirty;
+    outgoing.spritesOwned = levelSpritesOwned();
+    outgoing.map.swap(*map);
+    outgoing.mapFloors.swap(*mapFloors);
+    outgoing.mapCeiling.swap(*mapCeiling);
+    outgoing.sprites.swap(sprites);
+
+    map->swap(incoming.map);
+    mapFloors->swap(incoming.mapFloors);
+    mapCeiling->swap(incoming.mapCeiling);
+    sprites.swap(incoming.sprites);
+    mapWidth = incoming.mapWidth;
+    mapHeight = incoming.mapHeight;
+    levelDirty = incoming.dirty;
+    levelSpritesLoaded = incoming.spritesOwned;
+    levelSpritesVersion = sprites.version;
+
+    {
+        std::lock_guard<std::mutex> lock(levelCacheMutex);
+        auto it = findCachedLevel(outgoing.index);
+        if (it != levelCache.end())
+        {
+            levelCache.erase(it);
+        }
+        levelCache.push_front(std::move(outgoing));
+        currentLevel = index;
+        trimLevelCache();
+    }
+
+    std::cout << "Switched to level " << index + 1 << " (" << levelPaths[index] << ")" << (levelDirty ? " [unsaved]" : "") << std::endl;
+    prefetchLevel(index - 1);
+    prefetchLevel(index + 1);
+    return true;
+}
+
+void saveLevels(const std::vector<int> &map, const std::vector<int> &mapFloors, const std::vector<int> &mapCeiling)
+{
+    if (levelDirty)
+    {
+        serialize(mapWidth, mapHeight, map, mapFloors, mapCeiling, levelPaths[currentLevel]);
+        if (levelSpritesOwned())
+        {
+            sprites.setGrid(mapWidth, mapHeight);
+            serializeSprites(sprites, levelSpritePaths[currentLevel]);
+            levelSpritesLoaded = true;
+        }
+        levelDirty = false;
+    }
+
+    std::lock_guard<std::mutex> lock(levelCacheMutex);
+    for (Level &level : levelCache)
+    {
+        if (level.dirty)
+        {
+            serialize(level.mapWidth, level.mapHeight, level.map, level.mapFloors, level.mapCeiling, levelPaths[level.index]);
+            if (level.spritesOwned)
+            {
+                level.sprites.setGrid(level.mapWidth, level.mapHeight);
+                serializeSprites(level.sprites, levelSpritePaths[level.index]);
+            }
+            level.dirty = false;
+        }
+    }
+    trimLevelCache();
+}
+
+enum GeneratorStyle
+{
+    Rooms,
+    Caves
+};
+
+int generatorThreads = 0; // 0 uses every hardware thread
+const int generatorChunkRows = 32;
+const int generatorMaxSide = 16384; // keeps width * height inside an int
+
+// every random value is a pure function of the seed and the cell, so results never depend on thread count
+uint64_t mixBits(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+float cellRandom(uint64_t seed, int stream, int x, int y)
+{
+    uint64_t h = mixBits(seed ^ mixBits((static_cast<uint64_t>(stream) << 48) ^ (static_cast<uint64_t>(static_cast<uint32_t>(y)) << 24) ^ static_cast<uint32_t>(x)));
+    return (h >> 40) * (1.0f / 16777216.0f);
+}
+
+struct SeededRandom
+{
+    uint64_t state;
+    uint64_t next() { return mixBits(state++); }
+    int range(int lo, int hi) { return hi <= lo ? lo : lo + static_cast<int>(next() % (hi - lo + 1)); }
+};
+
+// threads started on first use and kept for every later forEachChunk, the caller works too so
+// helpers is one less than the thread count of a job
+struct ChunkWorkers
+{
+    std::vector<std::thread> threads;
+    std::mutex submitMutex; // one job at a time
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(int, int)> *job = nullptr;
+    int rows = 0;
+    int chunks = 0;
+    int helpers = 0;
+    int busy = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+    std::atomic<int> nextChunk{0};
+
+    void work(const std::function<void(int, int)> &fn, int rows, int chunks)
+    {
+        int chunk;
+        while ((chunk = nextChunk++) < chunks)
+        {
+            fn(chunk * generatorChunkRows, std::min(rows, (chunk + 1) * generatorChunkRows));
+        }
+    }
+
+    // seen is the generation when the thread was started, a job posted right after still wakes it
+    void run(int id, uint64_t seen)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wake.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping)
+            {
+                return;
+            }
+            seen = generation;
+            if (id >= helpers)
+            {
+                continue;
+            }
+            const std::function<void(int, int)> &fn = *job;
+            int jobRows = rows;
+            int jobChunks = chunks;
+            lock.unlock();
+            work(fn, jobRows, jobChunks);
+            lock.lock();
+            if (--busy == 0)
+            {
+                done.notify_one();
+            }
+        }
+    }
+
+    // must be called with mutex held
+    void start(int count)
+    {
+        while (static_cast<int>(threads.size()) < count)
+        {
+            int id = threads.size();
+            threads.emplace_back(&ChunkWorkers::run, this, id, generation);
+        }
+    }
+
+    ~ChunkWorkers()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+    }
+};
+
+ChunkWorkers chunkWorkers;
+
+// runs fn(firstRow, lastRow) over fixed size row chunks, chunk boundaries do not depend on the thread count
+void forEachChunk(int rows, const std::function<void(int, int)> &fn)
+{
+    int chunks = (rows + generatorChunkRows - 1) / generatorChunkRows;
+    int threadCount = generatorThreads > 0 ? generatorThreads : std::max(1u, std::thread::hardware_concurrency());
+    threadCount = std::min(threadCount, chunks);
+    if (threadCount <= 1)
+    {
+        for (int chunk = 0; chunk < chunks; chunk++)
+        {
+            fn(chunk * generatorChunkRows, std::min(rows, (chunk + 1) * generatorChunkRows));
+        }
+        return;
+    }
+
+    ChunkWorkers &workers = chunkWorkers;
+    std::lock_guard<std::mutex> submit(workers.submitMutex);
+    {
+        std::lock_guard<std::mutex> lock(workers.mutex);
+        workers.start(threadCount - 1);
+        workers.job = &fn;
+        workers.rows = rows;
+        workers.chunks = chunks;
+        workers.helpers = threadCount - 1;
+        workers.busy = threadCount - 1;
+        workers.nextChunk = 0;
+        workers.generation++;
+    }
+    workers.wake.notify_all();
+    workers.work(fn, rows, chunks);
+
+    std::unique_lock<std::mutex> lock(workers.mutex);
+    workers.done.wait(lock, [&]() { return workers.busy == 0; });
+}
+
+void carveRect(std::vector<int> *map, int mapWidth, int firstRow, int lastRow, const SDL_Rect &rect)
+{
+    int y0 = std::max(rect.y, firstRow);
+    int y1 = std::min(rect.y + rect.h, lastRow);
+    for (int y = y0; y < y1; y++)
+    {
+        std::fill(map->begin() + y * mapWidth + rect.x, map->begin() + y * mapWidth + rect.x + rect.w, 0);
+    }
+}
+
+void addCorridor(std::vector<SDL_Rect> *carves, SeededRandom *random, int ax, int ay, int bx, int by)
+{
+    // L shaped, one cell wide
+    if (random->next() & 1)
+    {
+        carves->push_back({std::min(ax, bx), ay, std::abs(bx - ax) + 1, 1});
+        carves->push_back({bx, std::min(ay, by), 1, std::abs(by - ay) + 1});
+    }
+    else
+    {
+        carves->push_back({ax, std::min(ay, by), 1, std::abs(by - ay) + 1});
+        carves->push_back({std::min(ax, bx), by, std::abs(bx - ax) + 1, 1});
+    }
+}
+
+// splits the area recursively, puts a room in every leaf and joins siblings with corridors
+SDL_Rect splitArea(SDL_Rect area, SeededRandom *random, std::vector<SDL_Rect> *carves)
+{
+    const int minLeaf = 8;
+    bool canSplitX = area.w >= minLeaf * 2;
+    bool canSplitY = area.h >= minLeaf * 2;
+    if (!canSplitX && !canSplitY)
+    {
+        int w = random->range(std::min(3, area.w - 2), area.w - 2);
+        int h = random->range(std::min(3, area.h - 2), area.h - 2);
+        SDL_Rect room = {area.x + random->range(1, area.w - w - 1), area.y + random->range(1, area.h - h - 1), w, h};
+        carves->push_back(room);
+        return room;
+    }
+
+    bool splitX = canSplitX && (!canSplitY || area.w > area.h || (area.w == area.h && (random->next() & 1)));
+    SDL_Rect first = area;
+    SDL_Rect second = area;
+    if (splitX)
+    {
+        int at = random->range(minLeaf, area.w - minLeaf);
+        first.w = at;
+        second.x += at;
+        second.w -= at;
+    }
+    else
+    {
+        int at = random->range(minLeaf, area.h - minLeaf);
+        first.h = at;
+        second.y += at;
+        second.h -= at;
+    }
+
+    SDL_Rect a = splitArea(first, random, carves);
+    SDL_Rect b = splitArea(second, random, carves);
+    addCorridor(carves, random, a.x + a.w / 2, a.y + a.h / 2, b.x + b.w / 2, b.y + b.h / 2);
+    return random->next() & 1 ? a : b;
+}
+
+void generateRooms(uint64_t seed, int mapWidth, int mapHeight, std::vector<int> *map)
+{
+    SeededRandom random = {seed};
+    std::vector<SDL_Rect> carves;
+    splitArea({1, 1, mapWidth - 2, mapHeight - 2}, &random, &carves);
+
+    // bucket the carves by the row chunks they touch so each chunk only visits its own
+    std::vector<std::vector<int>> chunkCarves((mapHeight + generatorChunkRows - 1) / generatorChunkRows);
+    for (int i = 0; i < carves.size(); i++)
+    {
+        for (int chunk = carves[i].y / generatorChunkRows; chunk <= (carves[i].y + carves[i].h - 1) / generatorChunkRows; chunk++)
+        {
+            chunkCarves[chunk].push_back(i);
+        }
+    }
+
+    forEachChunk(mapHeight, [&](int firstRow, int lastRow)
+                 {
+        std::fill(map->begin() + firstRow * mapWidth, map->begin() + lastRow * mapWidth, 1);
+        for (int i : chunkCarves[firstRow / generatorChunkRows])
+        {
+            carveRect(map, mapWidth, firstRow, lastRow, carves[i]);
+        } });
+}
+
+void generateCaves(uint64_t seed, int mapWidth, int mapHeight, std::vector<int> *map)
+{
+    std::vector<int> next(map->size());
+    forEachChunk(mapHeight, [&](int firstRow, int lastRow)
+                 {
+        for (int y = firstRow; y < lastRow; y++)
+        {
+            for (int x = 0; x < mapWidth; x++)
+            {
+                bool border = x == 0 || y == 0 || x == mapWidth - 1 || y == mapHeight - 1;
+                (*map)[x + y * mapWidth] = border || cellRandom(seed, 0, x, y) < 0.45f;
+            }
+        } });
+
+    for (int step = 0; step < 5; step++)
+    {
+        forEachChunk(mapHeight, [&](int firstRow, int lastRow)
+                     {
+            for (int y = firstRow; y < lastRow; y++)
+            {
+                for (int x = 0; x < mapWidth; x++)
+                {
+                    if (x == 0 || y == 0 || x == mapWidth - 1 || y == mapHeight - 1)
+                    {
+                        next[x + y * mapWidth] = 1;
+                        continue;
+                    }
+                    int walls = 0;
+                    for (int dy = -1; dy <= 1; dy++)
+                    {
+                        const int *row = map->data() + (y + dy) * mapWidth + x;
+                        walls += row[-1] + row[0] + row[1];
+                    }
+                    next[x + y * mapWidth] = walls >= 5;
+                }
+            } });
+        map->swap(next);
+    }
+
+    // join every cave pocket to the previous one so the whole level is reachable
+    std::vector<int> region(map->size(), -1);
+    std::vector<int> stack;
+    int px = -1, py = -1;
+    for (int start = 0; start < map->size(); start++)
+    {
+        if ((*map)[start] != 0 || region[start] != -1)
+        {
+            continue;
+        }
+        region[start] = start;
+        stack.push_back(start);
+        while (!stack.empty())
+        {
+            int cell = stack.back();
+            stack.pop_back();
+            int neighbours[4] = {cell - 1, cell + 1, cell - mapWidth, cell + mapWidth};
+            for (int n : neighbours)
+            {
+                if ((*map)[n] == 0 && region[n] == -1)
+                {
+                    region[n] = start;
+                    stack.push_back(n);
+                }
+            }
+        }
+
+        int x = start % mapWidth;
+        int y = start / mapWidth;
+        if (px != -1)
+        {
+            std::vector<SDL_Rect> carves;
+            SeededRandom random = {seed ^ mixBits(start)};
+            addCorridor(&carves, &random, px, py, x, y);
+            for (const SDL_Rect &rect : carves)
+            {
+                carveRect(map, mapWidth, 0, mapHeight, rect);
+            }
+        }
+        px = x;
+        py = y;
+    }
+}
+
+// fills the three layers and places sprites, the same seed and size always give the same level
+void generateLevel(uint64_t seed, int style, int *width, int *height, std::vector<int> *map, std::vector<int> *mapFloors, std::vector<int> *mapCeiling, SpritePool *sprites)
+{
+    *width = std::max(*width, 8);
+    *height = std::max(*height, 8);
+    int mapWidth = *width;
+    int mapHeight = *height;
+    map->assign(mapWidth * mapHeight, 0);
+    mapFloors->assign(mapWidth * mapHeight, 0);
+    mapCeiling->assign(mapWidth * mapHeight, 0);
+    sprites->clear();
+
+    if (style == GeneratorStyle::Caves)
+        generateCaves(seed, mapWidth, mapHeight, map);
+    else
+        generateRooms(seed, mapWidth, mapHeight, map);
+
+    int wall = style == GeneratorStyle::Caves ? 11 : 8;
+    int crackedWall = style == GeneratorStyle::Caves ? 12 : 9;
+    const SpriteType placed[] = {Coin, Enemy, Spike, GoldBar, HammerEnemy, ShooterEnemy, DroneEnemy};
+    const float chance[] = {0.03f, 0.008f, 0.006f, 0.003f, 0.002f, 0.002f, 0.001f};
+
+    int chunks = (mapHeight + generatorChunkRows - 1) / generatorChunkRows;
+    std::vector<std::vector<Sprite>> chunkSprites(chunks);
+    forEachChunk(mapHeight, [&](int firstRow, int lastRow)
+                 {
+        std::vector<Sprite> &placedSprites = chunkSprites[firstRow / generatorChunkRows];
+        for (int y = firstRow; y < lastRow; y++)
+        {
+            for (int x = 0; x < mapWidth; x++)
+            {
+                int cell = x + y * mapWidth;
+                mapFloors->at(cell) = cellRandom(seed, 1, x, y) < 0.05f ? 16 : 10;
+                mapCeiling->at(cell) = 14;
+                if ((*map)[cell] != 0)
+                {
+                    (*map)[cell] = cellRandom(seed, 2, x, y) < 0.1f ? crackedWall : wall;
+                    continue;
+                }
+
+                float r = cellRandom(seed, 3, x, y);
+                for (int i = 0; i < sizeof(placed) / sizeof(placed[0]); i++)
+                {
+                    if (r < chance[i])
+                    {
+                        Sprite sprite;
+                        // sprite files number types from 1 like the palette does
+                        sprite.type = static_cast<SpriteType>(placed[i] + 1);
+                        sprite.active = true;
+                        sprite.x = x * 64 + 32;
+                        sprite.y = y * 64 + 32;
+                        sprite.z = 0;
+                        placedSprites.emplace_back(sprite);
+                        break;
+                    }
+                    r -= chance[i];
+                }
+            }
+        } });
+
+    for (std::vector<Sprite> &chunk : chunkSprites)
+    {
+        for (const Sprite &sprite : chunk)
+        {
+            sprites->add(sprite);
+        }
+    }
+
+    // one key in an open cell picked from the seed alone
+    SeededRandom random = {seed ^ 0x4B4559ull};
+    for (int attempt = 0; attempt < 1000; attempt++)
+    {
+        int x = random.range(1, mapWidth - 2);
+        int y = random.range(1, mapHeight - 2);
+        if ((*map)[x + y * mapWidth] == 0)
+        {
+            Sprite key;
+            key.type = static_cast<SpriteType>(SpriteType::Key + 1);
+            key.active = true;
+            key.x = x * 64 + 32;
+            key.y = y * 64 + 32;
+            key.z = 0;
+            sprites->add(key);
+            break;
+        }
+    }
+}
+
+const char *nextToken(const char *p, const char **end)
+{
+    while (*p == ' ' || *p == '\t')
+        p++;
+    *end = p;
+    while (**end && **end != ' ' && **end != '\t' && **end != '\r' && **end != '\n')
+        (*end)++;
+    return p;
+}
+
+// one edit per line: rect L X Y W H V | set L X Y V | sprite T X Y | edit ID SX SY Z HEALTH DIR
+// | move ID X Y | delete ID | save FILE | saveSprites FILE | generate SEED rooms|caves W H | sync TAG
+void parseScriptLine(const char *line, int client, std::vector<Edit> *edits)
+{
+    const char *end;
+    const char *word = nextToken(line, &end);
+    size_t length = end - word;
+    if (length == 0)
+    {
+        return;
+    }
+
+    Edit edit;
+    edit.client = client;
+    const char *p = end;
+    auto nextInt = [&]()
+    {
+        char *e;
+        long v = std::strtol(p, &e, 10);
+        if (e == p)
+            edit.type = Edit::Type::Invalid;
+        p = e;
+        return static_cast<int>(v);
+    };
+    auto nextFloat = [&]()
+    {
+        char *e;
+        float v = std::strtof(p, &e);
+        if (e == p)
+            edit.type = Edit::Type::Invalid;
+        p = e;
+        return v;
+    };
+    auto nextText = [&]()
+    {
+        const char *e;
+        const char *t = nextToken(p, &e);
+        if (e == t)
+            edit.type = Edit::Type::Invalid;
+        p = e;
+        return std::string(t, e - t);
+    };
+    auto is = [&](const char *name)
+    {
+        return length == std::strlen(name) && std::strncmp(word, name, length) == 0;
+    };
+
+    if (is("rect"))
+    {
+        edit.type = Edit::Type::PaintRect;
+        edit.layer = nextInt();
+        edit.x = nextInt();
+        edit.y = nextInt();
+        edit.w = nextInt();
+        edit.h = nextInt();
+        edit.value = nextInt();
+    }
+    else if (is("set"))
+    {
+        edit.type = Edit::Type::SetCell;
+        edit.layer = nextInt();
+        edit.x = nextInt();
+        edit.y = nextInt();
+        edit.value = nextInt();
+    }
+    else if (is("sprite"))
+    {
+        edit.type = Edit::Type::AddSprite;
+        edit.value = nextInt();
+        edit.spriteX = nextFloat();
+        edit.spriteY = nextFloat();
+    }
+    else if (is("edit"))
+    {
+        edit.type = Edit::Type::EditSprite;
+        edit.text = nextText();
+        edit.scaleX = nextFloat();
+        edit.scaleY = nextFloat();
+        edit.z = nextFloat();
+        edit.health = nextFloat();
+        edit.direction = nextFloat();
+    }
+    else if (is("move"))
+    {
+        edit.type = Edit::Type::MoveSprite;
+        edit.text = nextText();
+        edit.spriteX = nextFloat();
+        edit.spriteY = nextFloat();
+    }
+    else if (is("delete"))
+    {
+        edit.type = Edit::Type::DeleteSprite;
+        edit.text = nextText();
+    }
+    else if (is("save"))
+    {
+        edit.type = Edit::Type::Save;
+        edit.text = nextText();
+    }
+    else if (is("saveSprites"))
+    {
+        edit.type = Edit::Type::SaveSprites;
+        edit.text = nextText();
+    }
+    else if (is("generate"))
+    {
+        edit.type = Edit::Type::Generate;
+        char *e;
+        edit.seed = std::strtoull(p, &e, 10);
+        if (e == p)
+            edit.type = Edit::Type::Invalid;
+        p = e;
+        edit.layer = nextText() == "caves" ? GeneratorStyle::Caves : GeneratorStyle::Rooms;
+        edit.w = nextInt();
+        edit.h = nextInt();
+    }
+    else if (is("sync"))
+    {
+        edit.type = Edit::Type::Sync;
+        const char *e;
+        const char *t = nextToken(p, &e);
+        edit.text.assign(t, e - t);
+    }
+    edits->emplace_back(std::move(edit));
+}
+
+// identifiers are sprite handles
+int findSprite(const std::string &identifier)
+{
+    char *end;
+    unsigned long long handle = std::strtoull(identifier.c_str(), &end, 10);
+    if (end == identifier.c_str())
+    {
+        return -1;
+    }
+    return sprites.indexOf(static_cast<SpriteHandle>(handle));
+}
+
+// applies every queued edit, returns the number of edits that changed the level
+int applyScriptEdits(std::vector<int> *map, std::vector<int> *mapFloors, std::vector<int> *mapCeiling)
+{
+    static std::vector<Edit> edits;
+    static std::vector<std::pair<int, std::string>> acks;
+    // applied and rejected counts per client since its last sync
+    static std::vector<std::pair<int, std::pair<int, int>>> counts;
+    {
+        std::lock_guard<std::mutex> lock(scriptMutex);
+        edits.swap(scriptEdits);
+    }
+    if (edits.empty())
+    {
+        return 0;
+    }
+
+    std::vector<int> *layers[3] = {map, mapFloors, mapCeiling};
+    auto countFor = [&](int client) -> std::pair<int, int> &
+    {
+        for (auto &c : counts)
+        {
+            if (c.first == client)
+                return c.second;
+        }
+        counts.push_back({client, {0, 0}});
+        return counts.back().second;
+    };
+
+    int changed = 0;
+    for (Edit &edit : edits)
+    {
+        bool ok = true;
+        int changedBefore = changed;
+        switch (edit.type)
+        {
+        case Edit::Type::PaintRect:
+        case Edit::Type::SetCell:
+        {
+            int x0 = std::max(edit.x, 0);
+            int y0 = std::max(edit.y, 0);
+            int x1 = std::min(edit.x + edit.w, mapWidth);
+            int y1 = std::min(edit.y + edit.h, mapHeight);
+            if (edit.layer < 0 || edit.layer > 2 || x0 >= x1 || y0 >= y1)
+            {
+                ok = false;
+                break;
+            }
+            std::vector<int> &layer = *layers[edit.layer];
+            for (int y = y0; y < y1; y++)
+            {
+                std::fill(layer.begin() + y * mapWidth + x0, layer.begin() + y * mapWidth + x1, edit.value);
+            }
+            changed++;
+            break;
+        }
+        case Edit::Type::AddSprite:
+        {
+            // the same type numbers the palette places
+            if (edit.value <= 0 || edit.value > static_cast<int>(SpriteType::SwatBoss) + 1)
+            {
+                ok = false;
+                break;
+            }
+            Sprite sprite;
+            sprite.type = static_cast<SpriteType>(edit.value);
+            sprite.active = true;
+            sprite.x = edit.spriteX;
+            sprite.y = edit.spriteY;
+            sprite.z = 0;
+            sprites.add(sprite);
+            changed++;
+            break;
+        }
+        case Edit::Type::EditSprite:
+        {
+            int at = findSprite(edit.text);
+            if (at == -1)
+            {
+                ok = false;
+                break;
+            }
+            sprites[at].scaleX = edit.scaleX;
+            sprites[at].scaleY = edit.scaleY;
+            sprites[at].z = edit.z;
+            if (edit.direction != -1)
+            {
+                sprites.setDirection(at, edit.direction);
+            }
+            if (edit.health != -1)
+            {
+                sprites.setHealth(at, edit.health);
+            }
+            changed++;
+            break;
+        }
+        case Edit::Type::MoveSprite:
+        {
+            int at = findSprite(edit.text);
+            if (at == -1)
+            {
+                ok = false;
+                break;
+            }
+            sprites.move(at, edit.spriteX, edit.spriteY);
+            changed++;
+            break;
+        }
+        case Edit::Type::DeleteSprite:
+        {
+            int at = findSprite(edit.text);
+            if (at == -1)
+            {
+                ok = false;
+                break;
+            }
+            sprites.removeAt(at);
+            changed++;
+            break;
+        }
+        case Edit::Type::Save:
+            serialize(mapWidth, mapHeight, *map, *mapFloors, *mapCeiling, edit.text);
+            if (edit.text == levelPaths[currentLevel])
+            {
+                levelDirty = false;
+            }
+            break;
+        case Edit::Type::SaveSprites:
+            sprites.setGrid(mapWidth, mapHeight);
+            serializeSprites(sprites, edit.text);
+            break;
+        case Edit::Type::Generate:
+            mapWidth = std::min(edit.w, generatorMaxSide);
+            mapHeight = std::min(edit.h, generatorMaxSide);
+            generateLevel(edit.seed, edit.layer, &mapWidth, &mapHeight, map, mapFloors, mapCeiling, &sprites);
+            changed++;
+            break;
+        case Edit::Type::Sync:
+        {
+            std::pair<int, int> &count = countFor(edit.client);
+            acks.push_back({edit.client, "ok " + edit.text + " " + std::to_string(count.first) + " " + std::to_string(count.second) + "\n"});
+            count = {0, 0};
+            continue;
+        }
+        default:
+            ok = false;
+            break;
+        }
+
+        // in edit order, so a save of the open level only counts the edits before it
+        if (changed != changedBefore)
+        {
+            levelDirty = true;
+        }
+
+        std::pair<int, int> &count = countFor(edit.client);
+        if (ok)
+            count.first++;
+        else
+            count.second++;
+    }
+    edits.clear();
+    if (!acks.empty())
+    {
+        std::lock_guard<std::mutex> lock(scriptMutex);
+        for (auto &ack : acks)
+        {
+            // client 0 is the stdin script
+            if (ack.first == 0)
+                std::cout << ack.second;
+            else
+                scriptAcks.emplace_back(std::move(ack));
+        }
+        std::cout.flush();
+        acks.clear();
+    }
+    return changed;
+}
+
+void queueScriptEdits(std::vector<Edit> *edits)
+{
+    if (edits->empty())
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(scriptMutex);
+    if (scriptEdits.empty())
+    {
+        scriptEdits.swap(*edits);
+    }
+    else
+    {
+        scriptEdits.insert(scriptEdits.end(), std::make_move_iterator(edits->begin()), std::make_move_iterator(edits->end()));
+    }
+    edits->clear();
+}
+
+// non-interactive mode, the script is read from stdin and acknowledgements go to stdout
+void scriptCommands()
+{
+    std::vector<Edit> edits;
+    std::string line;
+    while (running && std::getline(std::cin, line))
+    {
+        if (line == "quit")
+        {
+            break;
+        }
+        parseScriptLine(line.c_str(), 0, &edits);
+        // keep reading while more input is already buffered so a pipelined batch reaches the editor together
+        if (edits.size() >= 4096 || std::cin.rdbuf()->in_avail() <= 0)
+        {
+            queueScriptEdits(&edits);
+        }
+    }
+    queueScriptEdits(&edits);
+
+    // let the main loop apply what is left before closing the editor
+    while (running)
+    {
+        {
+            std::lock_guard<std::mutex> lock(scriptMutex);
+            if (scriptEdits.empty())
+            {
+                break;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(16));
+    }
+    running = false;
+}
+
+#ifndef _WIN32
+void socketCommands(std::string path)
+{
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0)
+    {
+        std::cerr << "Error creating script socket.\n";
+        return;
+    }
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    unlink(path.c_str());
+    if (bind(server, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || listen(server, 8) < 0)
+    {
+        std::cerr << "Error binding script socket " << path << ".\n";
+        close(server);
+        return;
+    }
+    std::cout << "Listening for scripts on " << path << std::endl;
+
+    // client sockets are non-blocking, acks a client is slow to take wait in outgoing
+    struct Client
+    {
+        int fd;
+        int id;
+        std::string pending;
+        std::string outgoing;
+    };
+    std::vector<Client> clients;
+    std::vector<pollfd> fds;
+    std::vector<Edit> edits;
+    std::vector<char> buffer(1 << 16);
+    int nextClient = 1;
+
+    while (running)
+    {
+        fds.clear();
+        fds.push_back({server, POLLIN, 0});
+        for (const Client &client : clients)
+        {
+            fds.push_back({client.fd, static_cast<short>(client.outgoing.empty() ? POLLIN : POLLIN | POLLOUT), 0});
+        }
+        poll(fds.data(), fds.size(), 8);
+
+        // only the clients that were polled, new ones are accepted after this loop
+        for (int i = fds.size() - 2; i >= 0; i--)
+        {
+            if (!(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+            {
+                continue;
+            }
+            Client &client = clients[i];
+            ssize_t n = read(client.fd, buffer.data(), buffer.size());
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                close(client.fd);
+                clients.erase(clients.begin() + i);
+                continue;
+            }
+
+            client.pending.append(buffer.data(), n);
+            size_t start = 0;
+            size_t newline;
+            while ((newline = client.pending.find('\n', start)) != std::string::npos)
+            {
+                client.pending[newline] = '\0';
+                parseScriptLine(client.pending.c_str() + start, client.id, &edits);
+                start = newline + 1;
+            }
+            client.pending.erase(0, start);
+        }
+        queueScriptEdits(&edits);
+
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = accept(server, nullptr, nullptr);
+            if (fd >= 0)
+            {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+                clients.push_back({fd, nextClient++, std::string(), std::string()});
+            }
+        }
+
+        std::vector<std::pair<int, std::string>> acks;
+        {
+            std::lock_guard<std::mutex> lock(scriptMutex);
+            acks.swap(scriptAcks);
+        }
+        for (auto &ack : acks)
+        {
+            for (Client &client : clients)
+            {
+                if (client.id == ack.first)
+                {
+                    client.outgoing += ack.second;
+                }
+            }
+        }
+        for (Client &client : clients)
+        {
+            if (!client.outgoing.empty())
+            {
+                ssize_t sent = send(client.fd, client.outgoing.data(), client.outgoing.size(), MSG_NOSIGNAL);
+                if (sent > 0)
+                {
+                    client.outgoing.erase(0, sent);
+                }
+            }
+        }
+    }
+
+    for (const Client &client : clients)
+    {
+        close(client.fd);
+    }
+    close(server);
+    unlink(path.c_str());
+}
+#endif
+
+Uint32 averageColour(SDL_Surface *surface)
+{
+    SDL_Surface *converted = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_ARGB8888, 0);
+    if (!converted)
+    {
+        return 0xFFFF00FF;
+    }
+
+    // weighted by alpha so transparent pixels do not darken sprites
+    uint64_t r = 0, g = 0, b = 0, a = 0;
+    SDL_LockSurface(converted);
+    for (int y = 0; y < converted->h; y++)
+    {
+        const Uint32 *row = reinterpret_cast<const Uint32 *>(static_cast<const Uint8 *>(converted->pixels) + y * converted->pitch);
+        for (int x = 0; x < converted->w; x++)
+        {
+            Uint32 alpha = row[x] >> 24;
+            r += ((row[x] >> 16) & 0xFF) * alpha;
+            g += ((row[x] >> 8) & 0xFF) * alpha;
+            b += (row[x] & 0xFF) * alpha;
+            a += alpha;
+        }
+    }
+    SDL_UnlockSurface(converted);
+    SDL_FreeSurface(converted);
+
+    if (a == 0)
+    {
+        return 0xFF000000;
+    }
+    return 0xFF000000 | static_cast<Uint32>(r / a) << 16 | static_cast<Uint32>(g / a) << 8 | static_cast<Uint32>(b / a);
+}
+
+struct ReloadedTexture
+{
+    std::string path;
+    SDL_Surface *surface;
+};
+
+// decoded on the watcher thread, uploaded by the main loop
+std::mutex reloadMutex;
+std::vector<ReloadedTexture> reloadedTextures;
+
+#ifdef __linux__
+void watchTextures()
+{
+    int watcher = inotify_init1(IN_NONBLOCK);
+    if (watcher < 0 || inotify_add_watch(watcher, "./textures", IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        std::cerr << "Could not watch ./textures for changes.\n";
+        if (watcher >= 0)
+            close(watcher);
+        return;
+    }
+
+    alignas(inotify_event) char buffer[4096];
+    while (running)
+    {
+        pollfd fd = {watcher, POLLIN, 0};
+        if (poll(&fd, 1, 100) <= 0)
+        {
+            continue;
+        }
+
+        ssize_t length;
+        while ((length = read(watcher, buffer, sizeof(buffer))) > 0)
+        {
+            for (char *p = buffer; p < buffer + length;)
+            {
+                const inotify_event *event = reinterpret_cast<const inotify_event *>(p);
+                p += sizeof(inotify_event) + event->len;
+
+                std::string name = event->len ? event->name : "";
+                if (name.size() < 4 || name.compare(name.size() - 4, 4, ".png") != 0)
+                {
+                    continue;
+                }
+
+                std::string path = "./textures/" + name;
+                SDL_Surface *loaded = IMG_Load(path.c_str());
+                if (!loaded)
+                {
+                    printf("IMG_Load Error for %s: %s\n", path.c_str(), IMG_GetError());
+                    continue;
+                }
+                SDL_Surface *surface = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_ARGB8888, 0);
+                SDL_FreeSurface(loaded);
+                if (!surface)
+                {
+                    continue;
+                }
+
+                std::lock_guard<std::mutex> lock(reloadMutex);
+                reloadedTextures.push_back({path, surface});
+            }
+        }
+    }
+    close(watcher);
+}
+#endif
+
+void replaceTexture(SDL_Renderer *renderer, SDL_Texture **texture, SDL_Surface *surface)
+{
+    Uint32 format;
+    int w, h;
+    if (*texture && SDL_QueryTexture(*texture, &format, NULL, &w, &h) == 0 && format == surface->format->format && w == surface->w && h == surface->h)
+    {
+        SDL_UpdateTexture(*texture, NULL, surface->pixels, surface->pitch);
+        return;
+    }
+
+    SDL_Texture *replacement = SDL_CreateTextureFromSurface(renderer, surface);
+    if (!replacement)
+    {
+        printf("SDL_CreateTextureFromSurface Error: %s\n", SDL_GetError());
+        return;
+    }
+    SDL_DestroyTexture(*texture);
+    *texture = replacement;
+}
+
+// swaps in textures the watcher decoded, files that are not in use yet become new tile textures
+// render targets lose their pixels when the renderer resets them, after a device reset the textures themselves are gone
+void resetLayerCaches(bool deviceLost)
+{
+    for (LayerCache &cache : layerCaches)
+    {
+        if (deviceLost && cache.texture)
+        {
+            SDL_DestroyTexture(cache.texture);
+            cache.texture = nullptr;
+        }
+        cache.drawn.clear();
+    }
+    minimapCache.drawn.clear();
+}
+
+void applyReloadedTextures(SDL_Renderer *renderer)
+{
+    std::vector<ReloadedTexture> reloaded;
+    {
+        std::lock_guard<std::mutex> lock(reloadMutex);
+        if (reloadedTextures.empty())
+        {
+            return;
+        }
+        reloaded.swap(reloadedTextures);
+    }
+
+    for (ReloadedTexture &texture : reloaded)
+    {
+        bool used = false;
+        for (int i = 0; i < texturePaths.size(); i++)
+        {
+            if (texturePaths[i] == texture.path)
+            {
+                replaceTexture(renderer, &textures[i], texture.surface);
+                textureColours[i] = averageColour(texture.surface);
+                used = true;
+            }
+        }
+        for (int i = 0; i < spritePaths.size(); i++)
+        {
+            if (spritePaths[i] == texture.path)
+            {
+                replaceTexture(renderer, &spriteTextures[i], texture.surface);
+                spriteColours[i] = averageColour(texture.surface);
+                used = true;
+            }
+        }
+
+        if (used)
+        {
+            resetLayerCaches(false);
+            printf("Reloaded texture: %s\n", texture.path.c_str());
+        }
+        else
+        {
+            SDL_Texture *added = SDL_CreateTextureFromSurface(renderer, texture.surface);
+            if (added)
+            {
+                texturePaths.push_back(texture.path);
+                textures.push_back(added);
+                textureColours.push_back(averageColour(texture.surface));
+                resetLayerCaches(false);
+                printf("Added texture %d: %s\n", static_cast<int>(textures.size()), texture.path.c_str());
+            }
+        }
+        SDL_FreeSurface(texture.surface);
+    }
+}
+
+const int rasterCellSize = 6; // cells smaller than this are rasterized instead of drawn with their texture
+const Uint32 emptyCellColour = 0xFF1E1E1E;
+
+// pixels per cell on the 700 pixel grid, whole pixels while cells fit so the grid lines stay aligned,
+// a fraction once the map is wider than the grid so clicks map to cells like the rasterizer does
+float gridCellSize(int cells)
+{
+    return cells > 700 ? 700.0f / cells : 700 / cells;
+}
+
+void fillRow(Uint32 *row, int count, Uint32 colour)
+{
+#if defined(__SSE2__) || defined(_M_X64)
+    __m128i value = _mm_set1_epi32(static_cast<int>(colour));
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(row + i), value);
+    }
+    for (; i < count; i++)
+    {
+        row[i] = colour;
+    }
+#else
+    std::fill_n(row, count, colour);
+#endif
+}
+
+Uint32 cellColour(int cell, Uint32 emptyColour)
+{
+    if (cell <= 0)
+    {
+        return emptyColour;
+    }
+    return cell - 1 < textureColours.size() ? textureColours[cell - 1] : 0xFFFF00FF;
+}
+
+// writes one flat colour per cell into a pixelWidth x pixelHeight area, in parallel screen bands
+void rasterizeLayer(const std::vector<int> &layer, int mapWidth, int mapHeight, Uint32 *pixels, int pitch, int pixelWidth, int pixelHeight, Uint32 emptyColour)
+{
+    forEachChunk(pixelHeight, [&](int firstRow, int lastRow)
+                 {
+        int previousCellY = -1;
+        for (int py = firstRow; py < lastRow; py++)
+        {
+            Uint32 *row = pixels + py * pitch;
+            int cellY = static_cast<long long>(py) * mapHeight / pixelHeight;
+            if (cellY == previousCellY)
+            {
+                std::memcpy(row, row - pitch, pixelWidth * sizeof(Uint32));
+                continue;
+            }
+            previousCellY = cellY;
+
+            const int *cells = layer.data() + cellY * mapWidth;
+            for (int x = 0; x < mapWidth; x++)
+            {
+                int start = static_cast<long long>(x) * pixelWidth / mapWidth;
+                int end = static_cast<long long>(x + 1) * pixelWidth / mapWidth;
+                if (end > start)
+                {
+                    fillRow(row + start, end - start, cellColour(cells[x], emptyColour));
+                }
+            }
+        } });
+}
+
+void rasterizeSprites(int mapWidth, int mapHeight, Uint32 *pixels, int pitch, int pixelWidth, int pixelHeight)
+{
+    for (int i = 0; i < sprites.size(); i++)
+    {
+        const SpriteData &sprite = sprites[i];
+        int px = static_cast<int>(sprite.x / 64 * pixelWidth / mapWidth);
+        int py = static_cast<int>(sprite.y / 64 * pixelHeight / mapHeight);
+        if (px < 0 || py < 0 || px >= pixelWidth - 1 || py >= pixelHeight - 1)
+        {
+            continue;
+        }
+        Uint32 colour = spriteColours[sprite.type - 1];
+        pixels[py * pitch + px] = colour;
+        pixels[py * pitch + px + 1] = colour;
+        pixels[(py + 1) * pitch + px] = colour;
+        pixels[(py + 1) * pitch + px + 1] = colour;
+    }
+}
+
+void updateLayerCache(SDL_Renderer *renderer, LayerCache *cache, const std::vector<int> &layer, float width, float height, std::vector<Uint32> *scratch)
+{
+    if (!cache->texture)
+    {
+        cache->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, 700, 700);
+        if (!cache->texture)
+        {
+            return;
+        }
+        SDL_SetTextureBlendMode(cache->texture, SDL_BLENDMODE_BLEND);
+    }
+
+    bool rebuild = cache->drawn.size() != layer.size() || cache->cellWidth != width || cache->cellHeight != height;
+    if (width < rasterCellSize || height < rasterCellSize)
+    {
+        // tiny cells, one rasterized upload is cheaper than a draw call per changed cell
+        if (!rebuild && std::memcmp(cache->drawn.data(), layer.data(), layer.size() * sizeof(int)) == 0)
+        {
+            return;
+        }
+        int pixelWidth = width >= 1 ? static_cast<int>(width) * mapWidth : 700;
+        int pixelHeight = height >= 1 ? static_cast<int>(height) * mapHeight : 700;
+        std::fill(scratch->begin(), scratch->end(), 0);
+        rasterizeLayer(layer, mapWidth, mapHeight, scratch->data(), 700, pixelWidth, pixelHeight, 0);
+        SDL_UpdateTexture(cache->texture, NULL, scratch->data(), 700 * sizeof(Uint32));
+        cache->drawn = layer;
+    }
+    else
+    {
+        SDL_SetRenderTarget(renderer, cache->texture);
+        SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+        if (rebuild)
+        {
+            SDL_RenderClear(renderer);
+            cache->drawn.assign(layer.size(), 0);
+        }
+
+        for (int y = 0; y < mapHeight; y++)
+        {
+            const int *cells = layer.data() + y * mapWidth;
+            int *drawn = cache->drawn.data() + y * mapWidth;
+            if (!rebuild && std::memcmp(cells, drawn, mapWidth * sizeof(int)) == 0)
+            {
+                continue;
+            }
+            for (int x = 0; x < mapWidth; x++)
+            {
+                if (!rebuild && cells[x] == drawn[x])
+                {
+                    continue;
+                }
+                SDL_Rect square;
+                square.w = width - 1;
+                square.h = height - 1;
+                square.x = x * width + 1;
+                square.y = y * height + 1;
+                SDL_RenderFillRect(renderer, &square);
+                if (cells[x] > 0 && cells[x] - 1 < textures.size())
+                {
+                    SDL_RenderCopy(renderer, textures[cells[x] - 1], NULL, &square);
+                }
+                drawn[x] = cells[x];
+            }
+        }
+        SDL_SetRenderTarget(renderer, NULL);
+    }
+
+    cache->cellWidth = width;
+    cache->cellHeight = height;
+}
+
+// session recordings: the starting level is saved next to the recording as <file>.map.dat and
+// <file>.sprites.dat, the recording itself is a stream of tagged records, RecordLevel with the
+// starting level index comes first, then each frame starts with RecordFrame and is followed by
+// the events, key samples and console command of that frame
+enum RecordTag : uint8_t
+{
+    RecordFrame = 1,
+    RecordEvent,
+    RecordKeys,
+    RecordCommand,
+    RecordLevel
+};
+
+struct RecordedEvent
+{
+    uint32_t type;
+    int32_t x;
+    int32_t y;
+    int32_t sym;
+    uint16_t mod;
+    uint8_t buttons;
+    uint8_t reserved;
+};
+
+// the keys sampled with SDL_GetKeyboardState, one bit each
+const SDL_Scancode recordedKeys[] = {SDL_SCANCODE_0, SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3, SDL_SCANCODE_4, SDL_SCANCODE_5, SDL_SCANCODE_6, SDL_SCANCODE_7, SDL_SCANCODE_8, SDL_SCANCODE_9, SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_LSHIFT, SDL_SCANCODE_RSHIFT};
+
+std::ofstream recordFile;
+std::ifstream replayFile;
+uint16_t recordedKeyState = 0;
+Uint8 replayKeys[SDL_NUM_SCANCODES] = {};
+
+// a replay may only depend on the recording, so while recording or replaying nothing is read from
+// other level, sprite or prefab files, and a replay writes nothing but its <file>.out.* results
+bool refusedWhileRecording(const std::string &action)
+{
+    if (!recordFile.is_open() && !replayFile.is_open())
+    {
+        return false;
+    }
+    std::cout << action << " is disabled while recording or replaying." << std::endl;
+    return true;
+}
+
+bool skippedInReplay(const std::string &action)
+{
+    if (!replayFile.is_open())
+    {
+        return false;
+    }
+    std::cout << "Replay skipped " << action << "." << std::endl;
+    return true;
+}
+
+void writeRecordString(const std::string &text)
+{
+    uint32_t length = text.size();
+    recordFile.write(reinterpret_cast<const char *>(&length), sizeof(length));
+    recordFile.write(text.data(), length);
+}
+
+std::string readRecordString()
+{
+    uint32_t length = 0;
+    replayFile.read(reinterpret_cast<char *>(&length), sizeof(length));
+    std::string text(length, '\0');
+    replayFile.read(&text[0], length);
+    return text;
+}
+
+void recordFrame(uint32_t ticks)
+{
+    RecordTag tag = RecordFrame;
+    recordFile.write(reinterpret_cast<const char *>(&tag), sizeof(tag));
+    recordFile.write(reinterpret_cast<const char *>(&ticks), sizeof(ticks));
+}
+
+void recordEvent(const SDL_Event &event, Uint32 mouseButtons)
+{
+    if (event.type != SDL_QUIT && event.type != SDL_MOUSEMOTION && event.type != SDL_MOUSEBUTTONDOWN && event.type != SDL_KEYDOWN)
+    {
+        return;
+    }
+
+    RecordedEvent recorded = {};
+    recorded.type = event.type;
+    recorded.buttons = mouseButtons;
+    if (event.type == SDL_KEYDOWN)
+    {
+        recorded.sym = event.key.keysym.sym;
+        recorded.mod = event.key.keysym.mod;
+    }
+    else if (event.type != SDL_QUIT)
+    {
+        recorded.x = event.button.x;
+        recorded.y = event.button.y;
+    }
+
+    RecordTag tag = RecordEvent;
+    recordFile.write(reinterpret_cast<const char *>(&tag), sizeof(tag));
+    recordFile.write(reinterpret_cast<const char *>(&recorded), sizeof(recorded));
+}
+
+void recordKeys(const Uint8 *keystate)
+{
+    uint16_t mask = 0;
+    for (int i = 0; i < sizeof(recordedKeys) / sizeof(recordedKeys[0]); i++)
+    {
+        if (keystate[recordedKeys[i]])
+            mask |= 1 << i;
+    }
+    if (mask == recordedKeyState)
+    {
+        return;
+    }
+    recordedKeyState = mask;
+
+    RecordTag tag = RecordKeys;
+    recordFile.write(reinterpret_cast<const char *>(&tag), sizeof(tag));
+    recordFile.write(reinterpret_cast<const char *>(&mask), sizeof(mask));
+}
+
+void recordCommand(const Command &command)
+{
+    RecordTag tag = RecordCommand;
+    recordFile.write(reinterpret_cast<const char *>(&tag), sizeof(tag));
+    writeRecordString(command.cmd);
+    int dataType = static_cast<int>(command.dataType);
+    recordFile.write(reinterpret_cast<const char *>(&dataType), sizeof(dataType));
+
+    switch (command.dataType)
+    {
+    case Command::DataType::LoadData:
+        writeRecordString(command.data->loadData.fileName);
+        break;
+    case Command::DataType::SaveData:
+    case Command::DataType::SaveSpriteData:
+        writeRecordString(command.data->saveData.fileName);
+        break;
+    case Command::DataType::UnloadData:
+        recordFile.write(reinterpret_cast<const char *>(&command.data->unloadData), sizeof(int) * 2);
+        break;
+    case Command::DataType::LevelData:
+        recordFile.write(reinterpret_cast<const char *>(&command.data->levelData.index), sizeof(int));
+        break;
+    case Command::DataType::GenerateData:
+    {
+        const Command::Data::GenerateData &generate = command.data->generateData;
+        recordFile.write(reinterpret_cast<const char *>(&generate.seed), sizeof(generate.seed));
+        recordFile.write(reinterpret_cast<const char *>(&generate.style), sizeof(int));
+        recordFile.write(reinterpret_cast<const char *>(&generate.width), sizeof(int));
+        recordFile.write(reinterpret_cast<const char *>(&generate.height), sizeof(int));
+        break;
+    }
+    case Command::DataType::EditSpriteData:
+    {
+        const Command::Data::EditSpriteData &edit = command.data->editSpriteData;
+        recordFile.write(reinterpret_cast<const char *>(&edit.del), sizeof(edit.del));
+        recordFile.write(reinterpret_cast<const char *>(&edit.scaleX), sizeof(edit.scaleX));
+        recordFile.write(reinterpret_cast<const char *>(&edit.scaleY), sizeof(edit.scaleY));
+        recordFile.write(reinterpret_cast<const char *>(&edit.health), sizeof(edit.health));
+        recordFile.write(reinterpret_cast<const char *>(&edit.direction), sizeof(edit.direction));
+        recordFile.write(reinterpret_cast<const char *>(&edit.z), sizeof(edit.z));
+        writeRecordString(edit.identifier);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void readCommand(Command *command)
+{
+    command->clearData();
+    std::string cmd = readRecordString();
+    int dataType = 0;
+    replayFile.read(reinterpret_cast<char *>(&dataType), sizeof(dataType));
+
+    switch (static_cast<Command::DataType>(dataType))
+    {
+    case Command::DataType::LoadData:
+        command->setLoadData(readRecordString());
+        break;
+    case Command::DataType::SaveData:
+    case Command::DataType::SaveSpriteData:
+        command->setSaveData(readRecordString());
+        break;
+    case Command::DataType::UnloadData:
+    {
+        int size[2];
+        replayFile.read(reinterpret_cast<char *>(size), sizeof(size));
+        command->setUnloadData(size[0], size[1]);
+        break;
+    }
+    case Command::DataType::LevelData:
+    {
+        int index;
+        replayFile.read(reinterpret_cast<char *>(&index), sizeof(index));
+        command->setLevelData(index);
+        break;
+    }
+    case Command::DataType::GenerateData:
+    {
+        unsigned long long seed;
+        int style, w, h;
+        replayFile.read(reinterpret_cast<char *>(&seed), sizeof(seed));
+        replayFile.read(reinterpret_cast<char *>(&style), sizeof(style));
+        replayFile.read(reinterpret_cast<char *>(&w), sizeof(w));
+        replayFile.read(reinterpret_cast<char *>(&h), sizeof(h));
+        command->setGenerateData(seed, style, w, h);
+        break;
+    }
+    case Command::DataType::EditSpriteData:
+    {
+        bool del;
+        float scaleX, scaleY, direction;
+        int health, z;
+        replayFile.read(reinterpret_cast<char *>(&del), sizeof(del));
+        replayFile.read(reinterpret_cast<char *>(&scaleX), sizeof(scaleX));
+        replayFile.read(reinterpret_cast<char *>(&scaleY), sizeof(scaleY));
+        replayFile.read(reinterpret_cast<char *>(&health), sizeof(health));
+        replayFile.read(reinterpret_cast<char *>(&direction), sizeof(direction));
+        replayFile.read(reinterpret_cast<char *>(&z), sizeof(z));
+        command->setEditSpriteData(del, scaleX, scaleY, health, direction, readRecordString(), z);
+        break;
+    }
+    default:
+        break;
     }
+    command->cmd = cmd;
 }
 
-void deserializeSprites(const std::string &filename)
+// reads one recorded frame, the events are queued for nextReplayEvent, returns false at the end of the recording
+bool readReplayFrame(std::deque<RecordedEvent> *events, uint32_t *ticks)
 {
-    std::ifstream file(filename, std::ios::binary | std::ios::in);
-    if (file)
+    RecordTag tag;
+    if (!replayFile.read(reinterpret_cast<char *>(&tag), sizeof(tag)) || tag != RecordFrame)
     {
-        int spritesSize;
-        file.read(reinterpret_cast<char *>(&spritesSize), sizeof(int));
-        for (int i = 0; i < spritesSize; i++)
+        return false;
+    }
+    replayFile.read(reinterpret_cast<char *>(ticks), sizeof(*ticks));
+
+    while (replayFile.peek() != EOF && replayFile.peek() != RecordFrame)
+    {
+        replayFile.read(reinterpret_cast<char *>(&tag), sizeof(tag));
+        if (tag == RecordEvent)
         {
-            Sprite sprite;
-            int type;
-            file.read(reinterpret_cast<char *>(&type), sizeof(int));
-            sprite.type = static_cast<SpriteType>(type);
-            file.read(reinterpret_cast<char *>(&sprite.x), sizeof(float));
-            file.read(reinterpret_cast<char *>(&sprite.y), sizeof(float));
-            file.read(reinterpret_cast<char *>(&sprite.z), sizeof(float));
-            file.read(reinterpret_cast<char *>(&sprite.scaleX), sizeof(float));
-            file.read(reinterpret_cast<char *>(&sprite.scaleY), sizeof(float));
-            file.read(reinterpret_cast<char *>(&sprite.active), sizeof(bool));
-            bool hasHealth;
-            file.read(reinterpret_cast<char *>(&hasHealth), sizeof(bool));
-            if (hasHealth)
-            {
-                file.read(reinterpret_cast<char *>(&sprite.health), sizeof(float));
-            }
-            bool hasDirection;
-            file.read(reinterpret_cast<char *>(&hasDirection), sizeof(bool));
-            if (hasDirection)
+            RecordedEvent recorded;
+            replayFile.read(reinterpret_cast<char *>(&recorded), sizeof(recorded));
+            events->push_back(recorded);
+        }
+        else if (tag == RecordKeys)
+        {
+            uint16_t mask;
+            replayFile.read(reinterpret_cast<char *>(&mask), sizeof(mask));
+            for (int i = 0; i < sizeof(recordedKeys) / sizeof(recordedKeys[0]); i++)
             {
-                file.read(reinterpret_cast<char *>(&sprite.direction), sizeof(bool));
+                replayKeys[recordedKeys[i]] = (mask >> i) & 1;
             }
-            sprites.emplace_back(sprite);
         }
-        file.close();
+        else if (tag == RecordCommand)
+        {
+            std::lock_guard<std::mutex> lock(commandMutex);
+            readCommand(&command);
+        }
+        else
+        {
+            std::cerr << "Corrupt recording.\n";
+            return false;
+        }
     }
-    else
+    return true;
+}
+
+bool nextReplayEvent(std::deque<RecordedEvent> *events, SDL_Event *event, Uint32 *mouseButtons)
+{
+    if (events->empty())
     {
-        std::cerr << "Error opening file for reading.\n";
+        return false;
+    }
+    RecordedEvent recorded = events->front();
+    events->pop_front();
+
+    std::memset(event, 0, sizeof(*event));
+    event->type = recorded.type;
+    *mouseButtons = recorded.buttons;
+    if (recorded.type == SDL_KEYDOWN)
+    {
+        event->key.keysym.sym = recorded.sym;
+        event->key.keysym.mod = recorded.mod;
+    }
+    else if (recorded.type == SDL_MOUSEMOTION)
+    {
+        event->motion.x = recorded.x;
+        event->motion.y = recorded.y;
+    }
+    else if (recorded.type == SDL_MOUSEBUTTONDOWN)
+    {
+        event->button.x = recorded.x;
+        event->button.y = recorded.y;
     }
+    return true;
 }
 
 void consoleCommands()
@@ -372,6 +3194,12 @@ void consoleCommands()
             std::cout << "save - saves the current map" << std::endl;
             std::cout << "editSprite - edits a sprite" << std::endl;
             std::cout << "saveSprites - saves the sprites" << std::endl;
+            std::cout << "level - switches to another level ([ and ] cycle levels)" << std::endl;
+            std::cout << "saveLevels - saves every level with unsaved edits" << std::endl;
+            std::cout << "generate - generates a level from a seed" << std::endl;
+            std::cout << "exportBundle - writes the level, sprites and textures into one runtime bundle" << std::endl;
+            std::cout << "savePrefab - saves the clipboard to the prefab library" << std::endl;
+            std::cout << "loadPrefab - loads a prefab from the library into the clipboard" << std::endl;
         }
         if (input == "load" || "loadSprites")
         {
@@ -390,6 +3218,24 @@ void consoleCommands()
             command.setSaveData(fileName);
         }
 
+        if (input == "savePrefab" || input == "loadPrefab")
+        {
+            std::string name;
+            std::cout << "Enter a prefab name: ";
+            std::cin >> name;
+
+            command.setSaveData(name);
+        }
+
+        if (input == "exportBundle")
+        {
+            std::string fileName;
+            std::cout << "Enter a filename: ";
+            std::cin >> fileName;
+
+            command.setSaveData(fileName);
+        }
+
         if (input == "saveSprites")
         {
             std::string fileName;
@@ -412,6 +3258,34 @@ void consoleCommands()
             command.setUnloadData(w, h);
         }
 
+        if (input == "level")
+        {
+            int index;
+            std::cout << "Enter a level number (1-" << levelPaths.size() << "): ";
+            std::cin >> index;
+
+            command.setLevelData(index - 1);
+        }
+
+        if (input == "generate")
+        {
+            unsigned long long seed;
+            std::cout << "Enter a seed: ";
+            std::cin >> seed;
+
+            std::string style;
+            std::cout << "Style (rooms/caves): ";
+            std::cin >> style;
+
+            int w, h;
+            std::cout << "Enter the width of the map: ";
+            std::cin >> w;
+            std::cout << "Enter the height of the map: ";
+            std::cin >> h;
+
+            command.setGenerateData(seed, style == "caves" ? GeneratorStyle::Caves : GeneratorStyle::Rooms, w, h);
+        }
+
         if (input == "editSprite")
         {
             std::string identifier;
@@ -455,8 +3329,40 @@ void consoleCommands()
     }
 }
 
-int main()
+int main(int argc, char *argv[])
 {
+    bool script = false;
+    std::string socketPath;
+    std::string recordPath;
+    std::string replayPath;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--script")
+        {
+            script = true;
+        }
+        else if (arg == "--socket" && i + 1 < argc)
+        {
+            socketPath = argv[++i];
+        }
+        else if (arg == "--record" && i + 1 < argc)
+        {
+            recordPath = argv[++i];
+        }
+        else if (arg == "--replay" && i + 1 < argc)
+        {
+            replayPath = argv[++i];
+        }
+    }
+    bool replay = !replayPath.empty();
+    if (!recordPath.empty() && (script || !socketPath.empty()))
+    {
+        // script edits are not part of a recording, it would replay to a different level
+        std::cerr << "--record cannot be combined with --script or --socket.\n";
+        return 1;
+    }
+
     std::vector<int> map;
 
     std::vector<int> mapFloors;
@@ -464,11 +3370,56 @@ int main()
     std::vector<int> mapCeiling;
 
     std::string loadMap;
-    std::cout << "Do you want to load a map (Y/N)";
-    std::cin >> loadMap;
-    if (loadMap == "Y" || loadMap == "y")
+    if (replay)
+    {
+        replayFile.open(replayPath, std::ios::binary | std::ios::in);
+        if (!replayFile || !fileExists(replayPath + ".map.dat"))
+        {
+            std::cerr << "Error opening recording " << replayPath << ".\n";
+            return 1;
+        }
+        // no window, no console, the recording drives the main loop
+        SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+    }
+    else if (script)
+    {
+        std::ios::sync_with_stdio(false);
+        if (!fileExists(levelPaths[currentLevel]))
+        {
+            std::cerr << "Script mode needs " << levelPaths[currentLevel] << " to exist.\n";
+            return 1;
+        }
+        loadMap = "Y";
+    }
+    else
+    {
+        std::cout << "Do you want to load a map (Y/N)";
+        std::cin >> loadMap;
+    }
+    if (replay)
+    {
+        if (replayFile.peek() == RecordLevel)
+        {
+            RecordTag tag;
+            int32_t level;
+            replayFile.read(reinterpret_cast<char *>(&tag), sizeof(tag));
+            replayFile.read(reinterpret_cast<char *>(&level), sizeof(level));
+            currentLevel = level;
+        }
+        deserialize(&mapWidth, &mapHeight, &map, &mapFloors, &mapCeiling, replayPath + ".map.dat");
+        if (fileExists(replayPath + ".sprites.dat"))
+        {
+            deserializeSprites(&sprites, replayPath + ".sprites.dat");
+        }
+    }
+    else if (loadMap == "Y" || loadMap == "y")
     {
-        deserialize(&mapWidth, &mapHeight, &map, &mapFloors, &mapCeiling, "map.dat");
+        deserialize(&mapWidth, &mapHeight, &map, &mapFloors, &mapCeiling, levelPaths[currentLevel]);
+        if (fileExists(levelSpritePaths[currentLevel]))
+        {
+            deserializeSprites(&sprites, levelSpritePaths[currentLevel]);
+        }
+        levelSpritesLoaded = true;
     }
     else
     {
@@ -486,6 +3437,21 @@ int main()
         std::fill(map.begin(), map.end(), 0);
         std::fill(mapFloors.begin(), mapFloors.end(), 0);
         std::fill(mapCeiling.begin(), mapCeiling.end(), 0);
+        levelDirty = true;
+    }
+
+    sprites.setGrid(mapWidth, mapHeight);
+    levelSpritesVersion = sprites.version;
+
+    if (!recordPath.empty())
+    {
+        recordFile.open(recordPath, std::ios::binary | std::ios::out);
+        RecordTag tag = RecordLevel;
+        int32_t level = currentLevel;
+        recordFile.write(reinterpret_cast<const char *>(&tag), sizeof(tag));
+        recordFile.write(reinterpret_cast<const char *>(&level), sizeof(level));
+        serialize(mapWidth, mapHeight, map, mapFloors, mapCeiling, recordPath + ".map.dat");
+        serializeSprites(sprites, recordPath + ".sprites.dat");
     }
 
     std::vector<int> *currentMap = &map;
@@ -496,7 +3462,7 @@ int main()
         return 1;
     }
 
-    SDL_Window *window = SDL_CreateWindow("Raycaster map editor", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 1000, 700, SDL_WINDOW_SHOWN);
+    SDL_Window *window = SDL_CreateWindow("Raycaster map editor", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 1000, 700, replay ? SDL_WINDOW_HIDDEN : SDL_WINDOW_SHOWN);
     if (!window)
     {
         std::cerr << "Window could not be created! SDL_Error: " << SDL_GetError() << std::endl;
@@ -504,7 +3470,7 @@ int main()
         return 1;
     }
 
-    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, replay ? SDL_RENDERER_SOFTWARE : SDL_RENDERER_ACCELERATED);
     if (!renderer)
     {
         std::cerr << "Renderer could not be created! SDL_Error: " << SDL_GetError() << std::endl;
@@ -535,6 +3501,7 @@ int main()
         }
 
         SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
+        textureColours.emplace_back(averageColour(surface));
         SDL_FreeSurface(surface);
         if (!texture)
         {
@@ -561,6 +3528,7 @@ int main()
         }
 
         SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
+        spriteColours.emplace_back(averageColour(surface));
         SDL_FreeSurface(surface);
         if (!texture)
         {
@@ -572,60 +3540,239 @@ int main()
         }
         spriteTextures.emplace_back(texture);
     }
-    float width = 700 / mapWidth;
-    float height = 700 / mapHeight;
-    std::thread consoleThread(consoleCommands);
+
+    // CPU side buffers for the rasterized grid and the minimap in the strip right of the grid
+    std::vector<Uint32> gridPixels(700 * 700);
+    std::vector<Uint32> minimapPixels(300 * 300);
+    SDL_Texture *gridTexture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 700, 700);
+    SDL_Texture *minimapTexture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 300, 300);
+    float width = gridCellSize(mapWidth);
+    float height = gridCellSize(mapHeight);
+    std::thread consoleThread;
+    if (!replay)
+    {
+        consoleThread = std::thread(script ? scriptCommands : consoleCommands);
+    }
+#ifndef _WIN32
+    std::thread socketThread;
+    // script edits are not part of a recording, a replay must not take new ones
+    if (!socketPath.empty() && !replay)
+    {
+        socketThread = std::thread(socketCommands, socketPath);
+    }
+#else
+    if (!socketPath.empty())
+    {
+        std::cerr << "Script sockets are not supported on this platform.\n";
+    }
+#endif
+    std::thread prefetchThread(prefetchLevels);
+#ifdef __linux__
+    std::thread watchThread;
+    if (!replay)
+    {
+        watchThread = std::thread(watchTextures);
+    }
+#endif
+    prefetchLevel(currentLevel + 1);
+
+    std::ofstream timingFile;
+    if (replay)
+    {
+        timingFile.open(replayPath + ".timing.csv");
+        timingFile << "frame,recordedMs,frameMs\n";
+    }
+    std::deque<RecordedEvent> replayEvents;
+
+    // shift + left drag selects cells, ctrl + c/x/v copy, cut and paste them, ctrl + r/m rotate and mirror the clipboard
+    SDL_Rect selection = {0, 0, 0, 0};
+    bool selecting = false;
+    bool shiftHeld = false;
+    int selectStartX = 0;
+    int selectStartY = 0;
+    int mouseX = 0;
+    int mouseY = 0;
+    Prefab clipboard;
+    Uint32 recordStart = SDL_GetTicks();
+    int frame = 0;
     while (running)
     {
+        Uint64 frameStart = SDL_GetPerformanceCounter();
+        uint32_t ticks = SDL_GetTicks() - recordStart;
+        if (replay && !readReplayFrame(&replayEvents, &ticks))
+        {
+            running = false;
+            break;
+        }
+        if (recordFile.is_open())
+        {
+            recordFrame(ticks);
+        }
+        sprites.setGrid(mapWidth, mapHeight);
 
         SDL_Event event;
-        while (SDL_PollEvent(&event))
+        Uint32 mouseButtons = 0;
+        while (replay ? nextReplayEvent(&replayEvents, &event, &mouseButtons) : SDL_PollEvent(&event))
         {
+            if (!replay)
+            {
+                mouseButtons = SDL_GetMouseState(NULL, NULL);
+                if (recordFile.is_open())
+                {
+                    recordEvent(event, mouseButtons);
+                }
+            }
             if (event.type == SDL_QUIT)
             {
                 running = false;
             }
-            if ((event.type == SDL_MOUSEMOTION && SDL_GetMouseState(NULL, NULL) & SDL_BUTTON(SDL_BUTTON_LEFT)) || (event.type == SDL_MOUSEBUTTONDOWN && SDL_GetMouseState(NULL, NULL) & SDL_BUTTON(SDL_BUTTON_LEFT)))
+            if (event.type == SDL_RENDER_TARGETS_RESET)
+            {
+                resetLayerCaches(false);
+            }
+            if (event.type == SDL_RENDER_DEVICE_RESET)
+            {
+                resetLayerCaches(true);
+                SDL_DestroyTexture(gridTexture);
+                SDL_DestroyTexture(minimapTexture);
+                gridTexture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 700, 700);
+                minimapTexture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 300, 300);
+            }
+            if (event.type == SDL_MOUSEMOTION || event.type == SDL_MOUSEBUTTONDOWN)
+            {
+                mouseX = event.button.x;
+                mouseY = event.button.y;
+            }
+            if ((event.type == SDL_MOUSEMOTION && mouseButtons & SDL_BUTTON(SDL_BUTTON_LEFT)) || (event.type == SDL_MOUSEBUTTONDOWN && mouseButtons & SDL_BUTTON(SDL_BUTTON_LEFT)))
             {
                 int x = event.button.x;
                 int y = event.button.y;
                 int cellX = floor(x / width);
                 int cellY = floor(y / height);
-                if (cellX < mapWidth && cellY < mapHeight && cellX >= 0 && cellY >= 0)
+                if (event.type == SDL_MOUSEBUTTONDOWN)
+                {
+                    selecting = shiftHeld;
+                    selectStartX = cellX;
+                    selectStartY = cellY;
+                }
+                if (selecting)
+                {
+                    int x0 = std::clamp(std::min(selectStartX, cellX), 0, mapWidth - 1);
+                    int y0 = std::clamp(std::min(selectStartY, cellY), 0, mapHeight - 1);
+                    int x1 = std::clamp(std::max(selectStartX, cellX), 0, mapWidth - 1);
+                    int y1 = std::clamp(std::max(selectStartY, cellY), 0, mapHeight - 1);
+                    selection = {x0, y0, x1 - x0 + 1, y1 - y0 + 1};
+                }
+                else if (cellX < mapWidth && cellY < mapHeight && cellX >= 0 && cellY >= 0)
                 {
                     currentMap->at(cellX + cellY * mapWidth) = cellType;
+                    levelDirty = true;
                 }
             }
             else if (event.type == SDL_KEYDOWN)
             {
 
                 SDL_Keycode key = event.key.keysym.sym;
-                if (key == SDLK_p)
+                if (event.key.keysym.mod & KMOD_CTRL)
+                {
+                    // the selection may be stale after the map changed size
+                    bool hasSelection = selection.w > 0 && selection.x + selection.w <= mapWidth && selection.y + selection.h <= mapHeight;
+                    if ((key == SDLK_c || key == SDLK_x) && hasSelection)
+                    {
+                        copyRegion(selection, map, mapFloors, mapCeiling, &clipboard);
+                        if (key == SDLK_x)
+                        {
+                            clearRegion(selection, &map, &mapFloors, &mapCeiling);
+                            levelDirty = true;
+                        }
+                    }
+                    else if (key == SDLK_v && clipboard.width > 0)
+                    {
+                        pastePrefab(clipboard, floor(mouseX / width), floor(mouseY / height), &map, &mapFloors, &mapCeiling);
+                        levelDirty = true;
+                    }
+                    else if (key == SDLK_r)
+                    {
+                        rotatePrefab(&clipboard);
+                    }
+                    else if (key == SDLK_m)
+                    {
+                        mirrorPrefab(&clipboard);
+                    }
+                }
+                else if (key == SDLK_p)
                 {
+                    // textures 21-27 continue the third bank, anything added after that gets banks of nine
+                    int banks = textures.size() <= 27 ? 3 : 3 + (textures.size() - 27 + 8) / 9;
                     selected++;
-                    if (selected > 2)
+                    if (selected >= banks)
                     {
                         selected = 0;
                     }
                 }
+                else if (key == SDLK_c)
+                {
+                    compositeView = !compositeView;
+                }
+                else if (key == SDLK_COMMA || key == SDLK_PERIOD)
+                {
+                    int layer = currentMap == &map ? 0 : currentMap == &mapFloors ? 1 : 2;
+                    layerAlpha[layer] = std::clamp(layerAlpha[layer] + (key == SDLK_COMMA ? -32 : 32), 0, 255);
+                    std::cout << "Layer " << layer << " opacity: " << static_cast<int>(layerAlpha[layer]) << std::endl;
+                }
+                else if ((key == SDLK_LEFTBRACKET || key == SDLK_RIGHTBRACKET) && !refusedWhileRecording("Switching levels"))
+                {
+                    int index = currentLevel + (key == SDLK_LEFTBRACKET ? -1 : 1);
+                    if (switchLevel(index, &map, &mapFloors, &mapCeiling))
+                    {
+                        width = gridCellSize(mapWidth);
+                        height = gridCellSize(mapHeight);
+                    }
+                }
             }
-            else if (event.type == SDL_MOUSEBUTTONDOWN && SDL_GetMouseState(NULL, NULL) & SDL_BUTTON(SDL_BUTTON_RIGHT))
+            else if (event.type == SDL_MOUSEBUTTONDOWN && mouseButtons & SDL_BUTTON(SDL_BUTTON_RIGHT))
             {
                 if (cellType == 0)
                 {
                     int x = event.button.x;
                     int y = event.button.y;
 
-                    for (int i = sprites.size() - 1; i >= 0; --i)
+                    // only the cells within 10 pixels of the click can hold a hit, off map sprites sit in the edge cells
+                    auto cellRange = [](int pixel, float cellSize, int cells, int *first, int *last)
+                    {
+                        *first = std::clamp(static_cast<int>(std::floor((pixel - 10) / cellSize)), 0, cells - 1);
+                        *last = std::clamp(static_cast<int>(std::floor((pixel + 10) / cellSize)), 0, cells - 1);
+                    };
+                    int firstX = 0, lastX = -1, firstY = 0, lastY = -1;
+                    if (sprites.gridWidth > 0 && sprites.gridHeight > 0)
+                    {
+                        cellRange(x, width, sprites.gridWidth, &firstX, &lastX);
+                        cellRange(y, height, sprites.gridHeight, &firstY, &lastY);
+                    }
+
+                    std::vector<SpriteHandle> hits;
+                    for (int cellY = firstY; cellY <= lastY; cellY++)
                     {
-                        float dx = x - ((sprites[i].x / 64) * width);
-                        float dy = y - ((sprites[i].y / 64) * height);
-                        float distance = sqrt(dx * dx + dy * dy);
-                        if (distance < 10)
+                        for (int cellX = firstX; cellX <= lastX; cellX++)
                         {
-                            sprites.erase(sprites.begin() + i);
+                            int cell = cellX + cellY * sprites.gridWidth;
+                            for (uint32_t i = sprites.cellFirst[cell]; i != noCellSprite; i = sprites.cellNext[i])
+                            {
+                                float dx = x - ((sprites[i].x / 64) * width);
+                                float dy = y - ((sprites[i].y / 64) * height);
+                                float distance = sqrt(dx * dx + dy * dy);
+                                if (distance < 10)
+                                {
+                                    hits.push_back(sprites.handleAt(i));
+                                }
+                            }
                         }
                     }
+                    for (SpriteHandle handle : hits)
+                    {
+                        sprites.remove(handle);
+                        levelDirty = true;
+                    }
                 }
                 else if (cellType <= static_cast<int>(SpriteType::SwatBoss) + 1)
                 {
@@ -637,13 +3784,18 @@ int main()
                     sprite.x = (x / width) * 64;
                     sprite.y = (y / height) * 64;
                     sprite.z = 0;
-                    sprite.identifier = std::to_string(uniqueId++);
-                    sprites.emplace_back(sprite);
+                    std::cout << "Added sprite " << sprites.add(sprite) << std::endl;
+                    levelDirty = true;
                 }
             }
         }
 
-        const Uint8 *keystate = SDL_GetKeyboardState(NULL);
+        const Uint8 *keystate = replay ? replayKeys : SDL_GetKeyboardState(NULL);
+        if (recordFile.is_open())
+        {
+            recordKeys(keystate);
+        }
+        shiftHeld = keystate[SDL_SCANCODE_LSHIFT] || keystate[SDL_SCANCODE_RSHIFT];
         if (selected == 0)
         {
             if (keystate[SDL_SCANCODE_0])
@@ -744,6 +3896,28 @@ int main()
             {
                 cellType = 20;
             }
+            for (int digit = 3; digit <= 9; digit++)
+            {
+                if (keystate[SDL_SCANCODE_1 + digit - 1] && 18 + digit <= textures.size())
+                {
+                    cellType = 18 + digit;
+                }
+            }
+        }
+        else
+        {
+            if (keystate[SDL_SCANCODE_0])
+            {
+                cellType = 0;
+            }
+            for (int digit = 1; digit <= 9; digit++)
+            {
+                int type = 27 + (selected - 3) * 9 + digit;
+                if (keystate[SDL_SCANCODE_1 + digit - 1] && type <= textures.size())
+                {
+                    cellType = type;
+                }
+            }
         }
         if (keystate[SDL_SCANCODE_Q])
         {
@@ -758,34 +3932,70 @@ int main()
             currentMap = &mapCeiling;
         }
 
+        applyReloadedTextures(renderer);
+
+        if (applyScriptEdits(&map, &mapFloors, &mapCeiling) > 0)
+        {
+            width = gridCellSize(mapWidth);
+            height = gridCellSize(mapHeight);
+        }
+
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
         SDL_RenderClear(renderer);
 
-        for (int x = 0; x < mapWidth; x++)
+        if (compositeView)
         {
-            for (int y = 0; y < mapHeight; y++)
+            // floors at the bottom, ceilings on top
+            const std::vector<int> *layers[3] = {&map, &mapFloors, &mapCeiling};
+            const int order[3] = {1, 0, 2};
+            SDL_Rect area = {0, 0, 700, 700};
+            for (int layer : order)
             {
-                SDL_Rect square;
-                square.w = width - 1;
-                square.h = height - 1;
-                square.x = x * width + 1;
-                square.y = y * height + 1;
-                if (currentMap->at(x + y * mapWidth) - 1 >= 0)
-                {
-                    SDL_RenderCopy(renderer, textures[currentMap->at(x + y * mapWidth) - 1], NULL, &square);
-                }
-                else
+                LayerCache &cache = layerCaches[layer];
+                updateLayerCache(renderer, &cache, *layers[layer], width, height, &gridPixels);
+                SDL_SetTextureAlphaMod(cache.texture, layerAlpha[layer]);
+                SDL_RenderCopy(renderer, cache.texture, NULL, &area);
+            }
+        }
+        else if (width < rasterCellSize || height < rasterCellSize)
+        {
+            // maps wider than the grid get several cells per pixel
+            int pixelWidth = width >= 1 ? static_cast<int>(width) * mapWidth : 700;
+            int pixelHeight = height >= 1 ? static_cast<int>(height) * mapHeight : 700;
+            rasterizeLayer(*currentMap, mapWidth, mapHeight, gridPixels.data(), 700, pixelWidth, pixelHeight, emptyCellColour);
+
+            SDL_Rect area = {0, 0, pixelWidth, pixelHeight};
+            SDL_UpdateTexture(gridTexture, &area, gridPixels.data(), 700 * sizeof(Uint32));
+            SDL_RenderCopy(renderer, gridTexture, &area, &area);
+        }
+        else
+        {
+            for (int x = 0; x < mapWidth; x++)
+            {
+                for (int y = 0; y < mapHeight; y++)
                 {
-                    SDL_SetRenderDrawColor(renderer, 30, 30, 30, 255);
-                }
+                    SDL_Rect square;
+                    square.w = width - 1;
+                    square.h = height - 1;
+                    square.x = x * width + 1;
+                    square.y = y * height + 1;
+                    if (currentMap->at(x + y * mapWidth) - 1 >= 0)
+                    {
+                        SDL_RenderCopy(renderer, textures[currentMap->at(x + y * mapWidth) - 1], NULL, &square);
+                    }
+                    else
+                    {
+                        SDL_SetRenderDrawColor(renderer, 30, 30, 30, 255);
+                    }
 
-                SDL_RenderDrawRect(renderer, &square);
+                    SDL_RenderDrawRect(renderer, &square);
+                }
             }
         }
 
         for (int i = 0; i < sprites.size(); i++)
         {
-            const Sprite &sprite = sprites.at(i);
+            const SpriteData &sprite = sprites[i];
             SDL_Rect square;
             square.w = 10;
             square.h = 10;
@@ -795,26 +4005,65 @@ int main()
             SDL_RenderCopy(renderer, spriteTextures[sprite.type - 1], NULL, &square);
         }
 
+        if (selection.w > 0)
+        {
+            SDL_Rect outline = {static_cast<int>(selection.x * width), static_cast<int>(selection.y * height), static_cast<int>(selection.w * width), static_cast<int>(selection.h * height)};
+            SDL_SetRenderDrawColor(renderer, 255, 220, 0, 255);
+            SDL_RenderDrawRect(renderer, &outline);
+        }
+
+        {
+            float scale = std::min(280.0f / mapWidth, 280.0f / mapHeight);
+            int pixelWidth = std::max(1, static_cast<int>(mapWidth * scale));
+            int pixelHeight = std::max(1, static_cast<int>(mapHeight * scale));
+            SDL_Rect area = {0, 0, pixelWidth, pixelHeight};
+            MinimapCache &cache = minimapCache;
+            if (cache.spriteVersion != sprites.version || cache.mapWidth != mapWidth || cache.pixelWidth != pixelWidth || cache.pixelHeight != pixelHeight ||
+                cache.drawn.size() != currentMap->size() || std::memcmp(cache.drawn.data(), currentMap->data(), currentMap->size() * sizeof(int)) != 0)
+            {
+                rasterizeLayer(*currentMap, mapWidth, mapHeight, minimapPixels.data(), 300, pixelWidth, pixelHeight, emptyCellColour);
+                rasterizeSprites(mapWidth, mapHeight, minimapPixels.data(), 300, pixelWidth, pixelHeight);
+                SDL_UpdateTexture(minimapTexture, &area, minimapPixels.data(), 300 * sizeof(Uint32));
+                cache.drawn = *currentMap;
+                cache.spriteVersion = sprites.version;
+                cache.mapWidth = mapWidth;
+                cache.pixelWidth = pixelWidth;
+                cache.pixelHeight = pixelHeight;
+            }
+
+            SDL_Rect minimap = {710, 10, pixelWidth, pixelHeight};
+            SDL_RenderCopy(renderer, minimapTexture, &area, &minimap);
+        }
+
         SDL_RenderPresent(renderer);
 
         {
             std::lock_guard<std::mutex> lock(commandMutex);
             if (!command.cmd.empty())
             {
+                if (recordFile.is_open())
+                {
+                    recordCommand(command);
+                }
                 std::cout << "Command received: " << command.cmd << std::endl;
                 if (command.cmd == "quit")
                 {
                     running = false;
                 }
-                else if (command.cmd == "save")
+                else if (command.cmd == "save" && !skippedInReplay(command.cmd))
                 {
                     serialize(mapWidth, mapHeight, map, mapFloors, mapCeiling, command.data->saveData.fileName);
+                    if (command.data->saveData.fileName == levelPaths[currentLevel])
+                    {
+                        levelDirty = false;
+                    }
                 }
-                else if (command.cmd == "load")
+                else if (command.cmd == "load" && !refusedWhileRecording(command.cmd))
                 {
                     deserialize(&mapWidth, &mapHeight, &map, &mapFloors, &mapCeiling, command.data->loadData.fileName);
-                    width = 700 / mapWidth;
-                    height = 700 / mapHeight;
+                    levelDirty = command.data->loadData.fileName != levelPaths[currentLevel];
+                    width = gridCellSize(mapWidth);
+                    height = gridCellSize(mapHeight);
                 }
                 else if (command.cmd == "unload")
                 {
@@ -832,70 +4081,162 @@ int main()
                     std::fill(map.begin(), map.end(), 0);
                     std::fill(mapFloors.begin(), mapFloors.end(), 0);
                     std::fill(mapCeiling.begin(), mapCeiling.end(), 0);
-                    width = 700 / mapWidth;
-                    height = 700 / mapHeight;
+                    levelDirty = true;
+                    levelSpritesLoaded = false;
+                    levelSpritesVersion = sprites.version;
+                    width = gridCellSize(mapWidth);
+                    height = gridCellSize(mapHeight);
                 }
                 else if (command.cmd == "editSprite")
                 {
-                    std::string ident = command.data->editSpriteData.identifier;
-                    std::unique_ptr<Sprite> sprite = nullptr;
-                    int at = -1;
-                    for (int i = 0; i < sprites.size(); i++)
-                    {
-                        if (sprites.at(i).identifier == ident)
-                        {
-                            sprite = std::make_unique<Sprite>(sprites.at(i));
-                            at = i;
-                        }
-                    }
+                    int at = findSprite(command.data->editSpriteData.identifier);
                     if (at != -1)
                     {
+                        levelDirty = true;
                         if (command.data->editSpriteData.del)
                         {
-                            sprites.erase(sprites.begin() + at);
+                            sprites.removeAt(at);
                         }
                         else
                         {
-                            sprites.at(at).scaleX = command.data->editSpriteData.scaleX;
-                            sprites.at(at).scaleY = command.data->editSpriteData.scaleY;
-                            sprites.at(at).z = command.data->editSpriteData.z;
+                            sprites[at].scaleX = command.data->editSpriteData.scaleX;
+                            sprites[at].scaleY = command.data->editSpriteData.scaleY;
+                            sprites[at].z = command.data->editSpriteData.z;
                             float dir = command.data->editSpriteData.direction;
                             if (dir != -1)
                             {
-                                sprites.at(at).direction = dir;
+                                sprites.setDirection(at, dir);
                             }
                             float health = command.data->editSpriteData.health;
                             if (health != -1)
                             {
-                                sprites.at(at).health = health;
+                                sprites.setHealth(at, health);
                             }
                         }
                     }
                 }
-                else if (command.cmd == "saveSprites")
+                else if (command.cmd == "savePrefab" && !skippedInReplay(command.cmd))
                 {
-                    serializeSprites(command.data->saveSpriteData.fileName);
+                    std::filesystem::create_directories(prefabDirectory);
+                    serializePrefab(clipboard, prefabDirectory + command.data->saveData.fileName + ".prefab");
                 }
-                else if (command.cmd == "loadSprites")
+                else if (command.cmd == "loadPrefab" && !refusedWhileRecording(command.cmd))
+                {
+                    deserializePrefab(&clipboard, prefabDirectory + command.data->saveData.fileName + ".prefab");
+                }
+                else if (command.cmd == "exportBundle" && !skippedInReplay(command.cmd))
+                {
+                    serializeBundle(mapWidth, mapHeight, map, mapFloors, mapCeiling, sprites, command.data->saveData.fileName);
+                }
+                else if (command.cmd == "saveSprites" && !skippedInReplay(command.cmd))
+                {
+                    serializeSprites(sprites, command.data->saveSpriteData.fileName);
+                }
+                else if (command.cmd == "loadSprites" && !refusedWhileRecording(command.cmd))
                 {
                     sprites.clear();
-                    deserializeSprites(command.data->loadData.fileName);
+                    deserializeSprites(&sprites, command.data->loadData.fileName);
+                    levelDirty = true;
+                }
+                else if (command.cmd == "level" && !refusedWhileRecording(command.cmd))
+                {
+                    if (switchLevel(command.data->levelData.index, &map, &mapFloors, &mapCeiling))
+                    {
+                        width = gridCellSize(mapWidth);
+                        height = gridCellSize(mapHeight);
+                    }
+                }
+                else if (command.cmd == "generate")
+                {
+                    const Command::Data::GenerateData &generate = command.data->generateData;
+                    mapWidth = std::min(generate.width, generatorMaxSide);
+                    mapHeight = std::min(generate.height, generatorMaxSide);
+                    generateLevel(generate.seed, generate.style, &mapWidth, &mapHeight, &map, &mapFloors, &mapCeiling, &sprites);
+                    levelDirty = true;
+                    width = gridCellSize(mapWidth);
+                    height = gridCellSize(mapHeight);
+                }
+                else if (command.cmd == "saveLevels" && !skippedInReplay(command.cmd))
+                {
+                    saveLevels(map, mapFloors, mapCeiling);
                 }
                 command.cmd.clear();
             }
         }
 
-        SDL_Delay(16);
+        if (replay)
+        {
+            double frameMs = (SDL_GetPerformanceCounter() - frameStart) * 1000.0 / SDL_GetPerformanceFrequency();
+            timingFile << frame << "," << ticks << "," << frameMs << "\n";
+        }
+        else
+        {
+            SDL_Delay(16);
+        }
+        frame++;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(levelCacheMutex);
+    }
+    prefetchCondition.notify_all();
+    prefetchThread.join();
+#ifdef __linux__
+    if (watchThread.joinable())
+    {
+        watchThread.join();
+    }
+#endif
+#ifndef _WIN32
+    if (socketThread.joinable())
+    {
+        socketThread.join();
+    }
+#endif
+    if (consoleThread.joinable())
+    {
+        consoleThread.join();
+    }
+
+    for (ReloadedTexture &texture : reloadedTextures)
+    {
+        SDL_FreeSurface(texture.surface);
     }
 
-    consoleThread.join();
+    SDL_DestroyTexture(gridTexture);
+    SDL_DestroyTexture(minimapTexture);
+    for (LayerCache &cache : layerCaches)
+    {
+        SDL_DestroyTexture(cache.texture);
+    }
 
     IMG_Quit();
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
 
-    serialize(mapWidth, mapHeight, map, mapFloors, mapCeiling, "map.dat");
+    if (replay)
+    {
+        // the replay result goes next to the recording instead of the exit autosave
+        serialize(mapWidth, mapHeight, map, mapFloors, mapCeiling, replayPath + ".out.map.dat");
+        serializeSprites(sprites, replayPath + ".out.sprites.dat");
+        return 0;
+    }
+
+    if (script)
+    {
+        // scripts save explicitly, their last level must not land in the working files
+        if (levelDirty)
+        {
+            std::cout << "Script mode does not autosave, unsaved edits were dropped." << std::endl;
+        }
+        return 0;
+    }
+
+    // the open level is always written on exit, cached levels only when they have edits,
+    // and each map goes out together with its sprites when they belong to it
+    levelDirty = true;
+    saveLevels(map, mapFloors, mapCeiling);
 
     return 0;
 }
\ No newline at end of file